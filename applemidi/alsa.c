@@ -16,6 +16,7 @@ They are called by MIDIDriver abstraction layer.
 #include "message.h"
 #include "applemidi.h"
 #include "clock.h"
+#include "applemidi_trace.h"
 
 #define SND_SEQ_EVENT_NOTEON 6
 #define SND_SEQ_EVENT_NOTEOFF 7
@@ -51,15 +52,25 @@ static int _alsa_input(struct snd_seq_event *ev, int direct, void *private_data,
 {
 	struct privateData *data = (struct privateData *)private_data;
 	pr_debug("callback from alsa received of type %d\n", ev->type);
+	trace_applemidi_alsa_input(ev->type, ev->data.note.channel,
+				   ev->data.note.note, ev->data.note.velocity);
 
-	spin_lock(&(data->drv->lock));
+	if (ev->type != SND_SEQ_EVENT_NOTEON &&
+	    ev->type != SND_SEQ_EVENT_NOTEOFF) {
+		return 1;
+	}
+
+	/*
+	 * send_lock is also taken in softirq context, where the sequencer
+	 * delivers queued events from its timer, so bottom halves have to be
+	 * off. Interrupts stay on, the packets are transmitted under the lock.
+	 */
+	spin_lock_bh(&(data->drv->send_lock));
 
 	if (ev->type == SND_SEQ_EVENT_NOTEON) {
 		data->msg.data.bytes[0] = 0x90;
-	} else if (ev->type == SND_SEQ_EVENT_NOTEOFF) {
-		data->msg.data.bytes[0] = 0x80;
 	} else {
-		return 1;
+		data->msg.data.bytes[0] = 0x80;
 	}
 	
 	//might be changed to ev->data.raw?? for event independant passing
@@ -76,7 +87,7 @@ static int _alsa_input(struct snd_seq_event *ev, int direct, void *private_data,
 
 	RTPMIDISessionSend(data->drv->rtpmidi_session, &(data->list));
 
-	spin_unlock(&(data->drv->lock));
+	spin_unlock_bh(&(data->drv->send_lock));
 
 	return 0;
 }
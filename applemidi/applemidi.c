@@ -7,12 +7,20 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/skbuff.h>
 #include <linux/inet.h>
 #include <linux/time.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/net_tstamp.h>
 #include <net/sock.h>
+#include <net/udp.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
 
 #include "applemidi.h"
 #include "rtp.h"
@@ -20,12 +28,34 @@
 #include "midi.h"
 #include "clock.h"
 
+#define CREATE_TRACE_POINTS
+#include "applemidi_trace.h"
+
+/* Any nonzero value enables the encap_rcv hook of a UDP socket. */
+#define APPLEMIDI_UDP_ENCAP 1
+
+/**
+ * @brief Control block of a queued control packet.
+ */
+struct applemidi_skb_cb
+{
+	struct sock *sk; /* the socket the packet was received on */
+	MIDITimestamp timestamp; /* arrival time of the packet */
+};
+
+#define APPLEMIDI_SKB_CB(skb) ((struct applemidi_skb_cb *)((skb)->cb))
+
 struct MIDIDriverAppleMIDI *raspi;
 
 int port = 5008;
 
 module_param(port, int, 0);
 
+int rx_cpu = -1;
+
+module_param(rx_cpu, int, 0444);
+MODULE_PARM_DESC(rx_cpu, "CPU to receive packets on (-1 for any)");
+
 /**
  * @brief Send the given AppleMIDI command.
  * Compose a message buffer and send the datagram to the given peer.
@@ -127,6 +157,8 @@ static int _applemidi_send_command(struct MIDIDriverAppleMIDI *driver,
 		}
 
 		pr_debug("sent %d of %d bytes\n", sentbytes, len);
+		trace_applemidi_command(true, command->type, ssrc,
+					to.sin_addr.s_addr, to.sin_port);
 
 		if (sentbytes != len) {
 			return 1;
@@ -137,68 +169,105 @@ static int _applemidi_send_command(struct MIDIDriverAppleMIDI *driver,
 	return 1;
 }
 
+/**
+ * @brief Find the UDP payload of a received datagram.
+ * The length in the UDP header is checked against the length of the skb,
+ * so a datagram can never be read beyond its end.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param skb The datagram; its transport header must be the UDP header.
+ * @param offset The offset of the payload in the skb.
+ * @param len The length of the payload.
+ * @param uh A pointer to the UDP header, may point to @c _uh.
+ * @param _uh Buffer for the UDP header, if it is not linear.
+ * @retval 0 On success.
+ * @retval >0 If the datagram is malformed.
+ */
+static int _applemidi_udp_payload(struct sk_buff *skb, int *offset, int *len,
+				  const struct udphdr **uh,
+				  struct udphdr *_uh)
+{
+	int transport = skb_transport_offset(skb);
+	int udp_len;
+
+	*uh = skb_header_pointer(skb, transport, sizeof(*_uh), _uh);
+	if (*uh == NULL)
+		return 1;
+
+	udp_len = ntohs((*uh)->len);
+	if (udp_len < sizeof(*_uh) || udp_len > skb->len - transport)
+		return 1;
+
+	*offset = transport + sizeof(*_uh);
+	*len = udp_len - sizeof(*_uh);
+	return 0;
+}
+
 /**
  * @brief Receive an AppleMIDI command.
- * Receive a datagram and decompose the message into the message structure.
+ * Decompose a received datagram into the command structure. All fields are
+ * read in place; a copy is only made by skb_header_pointer if the skb is
+ * not linear. The session name is truncated to the size of the name field.
  * @private @memberof MIDIDriverAppleMIDI
  * @param driver The driver.
- * @param fd The file descriptor to use for communication.
+ * @param skb The datagram.
  * @param command The command.
  * @retval 0 On success.
- * @retval >0 If the packet could not be sent.
+ * @retval >0 If the datagram is no valid AppleMIDI command.
  */
 static int _applemidi_recv_command(struct MIDIDriverAppleMIDI *driver,
 				   struct sk_buff *skb,
 				   struct AppleMIDICommand *command)
 {
-	unsigned int ssrc;
-	unsigned int msg[16];
-	int len, i;
-
-	struct iphdr *iph;
-	u16 *sp, *l;
-
-	command->size = sizeof(command->addr);
-
-	l = (u16 *)(skb->data + 4);
-	len = ntohs(*l) - 8;
+	const struct udphdr *uh;
+	const struct applemidi_header *hdr;
+	const struct applemidi_session *session;
+	const struct applemidi_sync *sync;
+	const struct applemidi_feedback *feedback;
+	struct udphdr _uh;
+	union {
+		struct applemidi_session session;
+		struct applemidi_sync sync;
+		struct applemidi_feedback feedback;
+	} buf;
+	unsigned long ssrc;
+	int offset, len, name_len;
 
-	memcpy(&msg[0], skb->data + 8, len);
+	if (_applemidi_udp_payload(skb, &offset, &len, &uh, &_uh))
+		return 1;
 
-	iph = (struct iphdr *)skb_network_header(skb);
+	hdr = skb_header_pointer(skb, offset, sizeof(*hdr), &buf);
+	if (hdr == NULL || ntohs(hdr->signature) != APPLEMIDI_PROTOCOL_SIGNATURE)
+		return 1;
 
-	command->addr.sin_addr.s_addr = iph->saddr;
+	command->size = sizeof(command->addr);
 	command->addr.sin_family = AF_INET;
-	sp = (unsigned short *)(skb->data);
-	command->addr.sin_port = *sp;
+	command->addr.sin_addr.s_addr = ip_hdr(skb)->saddr;
+	command->addr.sin_port = uh->source;
+	command->type = ntohs(hdr->command);
+	command->timestamp = APPLEMIDI_SKB_CB(skb)->timestamp;
 
 	pr_debug("received pkt from %pI4:%d\n", &command->addr.sin_addr.s_addr,
-		 ntohs(*sp));
-	for (i = 0; i < 16; i++) {
-		pr_debug("%x ", msg[i]);
-	}
-	pr_debug("\n");
-
-	command->type = ntohl(msg[0]) & 0xffff;
+		 ntohs(uh->source));
 
 	switch (command->type) {
 	case APPLEMIDI_COMMAND_INVITATION:
 	case APPLEMIDI_COMMAND_INVITATION_ACCEPTED:
 	case APPLEMIDI_COMMAND_INVITATION_REJECTED:
 	case APPLEMIDI_COMMAND_ENDSESSION:
-		if (len < 16)
+		if (len < sizeof(*session))
 			return 1;
-		command->data.session.version = ntohl(msg[1]);
-		command->data.session.token = ntohl(msg[2]);
-		command->data.session.ssrc = ntohl(msg[3]);
-		len -= 16;
-		if (len > 0) {
-			if (len > sizeof(command->data.session.name) - 1) {
-				len = sizeof(command->data.session.name) - 1;
-			}
-			memcpy(&(command->data.session.name[0]), &msg[4], len);
-			command->data.session.name[len] = '\0';
-		}
+		session = skb_header_pointer(skb, offset, sizeof(*session),
+					     &buf);
+		command->data.session.version = ntohl(session->version);
+		command->data.session.token = ntohl(session->token);
+		command->data.session.ssrc = ntohl(session->ssrc);
+
+		name_len = min_t(int, len - sizeof(*session),
+				 sizeof(command->data.session.name) - 1);
+		if (skb_copy_bits(skb, offset + sizeof(*session),
+				  command->data.session.name, name_len) < 0)
+			return 1;
+		command->data.session.name[name_len] = '\0';
 		ssrc = command->data.session.ssrc;
 
 		pr_debug(
@@ -209,19 +278,20 @@ static int _applemidi_recv_command(struct MIDIDriverAppleMIDI *driver,
 		    command->data.session.ssrc, command->data.session.name);
 		break;
 	case APPLEMIDI_COMMAND_SYNCHRONIZATION:
-		if (len != 36)
+		if (len != sizeof(*sync))
 			return 1;
-		command->data.sync.ssrc = ntohl(msg[1]);
-		command->data.sync.count = ntohl(msg[2]) >> 24;
+		sync = skb_header_pointer(skb, offset, sizeof(*sync), &buf);
+		command->data.sync.ssrc = ntohl(sync->ssrc);
+		command->data.sync.count = sync->count;
 		command->data.sync.timestamp1 =
-		    (unsigned long long)ntohl(msg[3]) << 32;
-		command->data.sync.timestamp1 += ntohl(msg[4]);
+		    (unsigned long long)ntohl(sync->timestamps[0]) << 32 |
+		    ntohl(sync->timestamps[1]);
 		command->data.sync.timestamp2 =
-		    (unsigned long long)ntohl(msg[5]) << 32;
-		command->data.sync.timestamp2 += ntohl(msg[6]);
+		    (unsigned long long)ntohl(sync->timestamps[2]) << 32 |
+		    ntohl(sync->timestamps[3]);
 		command->data.sync.timestamp3 =
-		    (unsigned long long)ntohl(msg[7]) << 32;
-		command->data.sync.timestamp3 += ntohl(msg[8]);
+		    (unsigned long long)ntohl(sync->timestamps[4]) << 32 |
+		    ntohl(sync->timestamps[5]);
 		ssrc = command->data.sync.ssrc;
 		pr_debug("found sync pkt: %c%c , ssrc:%lu, cnt=%lu, t1=%llu, "
 			 "t2=%llu, t3=%llu \n",
@@ -232,108 +302,307 @@ static int _applemidi_recv_command(struct MIDIDriverAppleMIDI *driver,
 			 command->data.sync.timestamp3);
 		break;
 	case APPLEMIDI_COMMAND_RECEIVER_FEEDBACK:
-		if (len != 12)
+		if (len != sizeof(*feedback))
 			return 1;
-		command->data.feedback.ssrc = ntohl(msg[1]);
-		command->data.feedback.seqnum = ntohl(msg[2]);
+		feedback = skb_header_pointer(skb, offset, sizeof(*feedback),
+					      &buf);
+		command->data.feedback.ssrc = ntohl(feedback->ssrc);
+		command->data.feedback.seqnum = ntohl(feedback->seqnum);
 		ssrc = command->data.feedback.ssrc;
 		break;
 	default:
 		return 1;
 	}
+	trace_applemidi_command(false, command->type, ssrc,
+				command->addr.sin_addr.s_addr,
+				command->addr.sin_port);
 	return 0;
 }
 
 /**
- * @brief Start or continue a synchronization session.
- * Continue a synchronization session identified by a given command.
- * The command must contain a pointer to a valid peer.
+ * @brief Look up a peer by its SSRC and retain it.
+ * @private @memberof MIDIDriverAppleMIDI
  * @param driver The driver.
- * @param fd The file descriptor to be used for communication.
- * @param command The previous sync command.
+ * @param ssrc The SSRC.
+ * @return the retained peer, or @c NULL if there is no such peer.
+ */
+static struct RTPPeer *_applemidi_get_peer(struct MIDIDriverAppleMIDI *driver,
+					   unsigned long ssrc)
+{
+	struct RTPPeer *peer = NULL;
+
+	if (RTPSessionFindPeerBySSRC(driver->rtp_session, &peer, ssrc))
+		return NULL;
+	return peer;
+}
+
+/**
+ * @brief Advance to the next peer of the session.
+ * The returned peer is retained, the given one is released.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param peer The current peer, @c NULL for the first one.
+ * @return the retained next peer, or @c NULL at the end. The iteration also
+ * ends if the current peer was removed from the session meanwhile.
+ */
+static struct RTPPeer *_applemidi_next_peer(struct MIDIDriverAppleMIDI *driver,
+					    struct RTPPeer *peer)
+{
+	struct RTPPeer *next = peer;
+
+	rcu_read_lock();
+	/* the peer was retained in an earlier read section */
+	if ((peer != NULL && !RTPPeerIsLinked(peer)) ||
+	    RTPSessionNextPeer(driver->rtp_session, &next) != 0 ||
+	    (next != NULL && RTPPeerTryRetain(next) != 0))
+		next = NULL;
+	rcu_read_unlock();
+	if (peer != NULL)
+		RTPPeerRelease(peer);
+	return next;
+}
+
+/**
+ * @brief Adapt the sync interval of a peer.
+ * Sync rapidly after the peer joined, then back off while the clock
+ * estimate is stable and tighten again when the samples scatter or the
+ * drift would exceed APPLEMIDI_SYNC_STABLE until the next exchange.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param peer The peer.
+ * @param stable Whether the last sample was accepted.
+ */
+static void _applemidi_sync_adapt(struct MIDIDriverAppleMIDI *driver,
+				  struct RTPPeer *peer, int stable)
+{
+	struct RTPPeerSync *sync = RTPPeerGetSync(peer);
+	long long error, jitter, offset, drift;
+	unsigned int interval = sync->interval;
+	int unknown;
+
+	spin_lock_bh(&driver->send_lock);
+	unknown = RTPPeerGetClockQuality(peer, &error, &jitter) ||
+	    RTPPeerGetClock(peer, 0, &offset, NULL, &drift);
+	spin_unlock_bh(&driver->send_lock);
+
+	if (unknown)
+		stable = 0;
+	else if (error > APPLEMIDI_SYNC_STABLE || jitter > APPLEMIDI_SYNC_STABLE)
+		stable = 0;
+	else if (div64_s64(abs64(drift) * 2 * interval * APPLEMIDI_CLOCK_RATE,
+			   1000LL * 1000000) > APPLEMIDI_SYNC_STABLE)
+		stable = 0;
+
+	if (sync->count < APPLEMIDI_SYNC_FAST_COUNT)
+		interval = APPLEMIDI_SYNC_INTERVAL_MIN;
+	else if (stable)
+		interval = min_t(unsigned int, interval * 2,
+				 APPLEMIDI_SYNC_INTERVAL_MAX);
+	else
+		interval = max_t(unsigned int, interval / 2,
+				 APPLEMIDI_SYNC_INTERVAL_MIN);
+
+	if (interval != sync->interval)
+		pr_debug("sync interval %u ms\n", interval);
+	sync->interval = interval;
+}
+
+/**
+ * @brief Finish a synchronization exchange with a peer.
+ * The result is added to the clock estimate of the peer, which is
+ * protected by the send lock.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param peer The peer.
+ * @param offset The clock of the peer minus the own clock.
+ * @param delay The one way delay.
+ * @param timestamp The own time of the exchange.
+ */
+static void _applemidi_sync_done(struct MIDIDriverAppleMIDI *driver,
+				 struct RTPPeer *peer, long long offset,
+				 long long delay, MIDITimestamp timestamp)
+{
+	struct RTPPeerSync *sync = RTPPeerGetSync(peer);
+	int rejected;
+
+	spin_lock_bh(&driver->send_lock);
+	rejected = RTPPeerAddClockSample(peer, offset, delay, timestamp);
+	spin_unlock_bh(&driver->send_lock);
+
+	sync->count++;
+	_applemidi_sync_adapt(driver, peer, !rejected);
+
+	/* a completed exchange started by the peer postpones ours */
+	sync->pending = 0;
+	sync->retries = 0;
+	sync->next = ktime_add_ms(ktime_get(), sync->interval);
+}
+
+/**
+ * @brief Continue a synchronization exchange.
+ * Handle a received CK command. Every peer has its own synchronization
+ * state, so exchanges with several peers may run at the same time. The
+ * peer starting an exchange sends CK 0 with its timestamp 1, the other
+ * side answers with CK 1 adding timestamp 2 and the starter completes
+ * it with CK 2 adding timestamp 3. Both sides compute the offset of the
+ * clocks assuming the delay is the same in both directions. Received
+ * commands are timed by their arrival, so the queueing on this host does
+ * not bias the offset.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param sk The socket the command was received on.
+ * @param command The received sync command, it is reused for the answer.
  * @retval 0 On success.
- * @retval >0 If the synchronization failed.
+ * @retval >0 If the command was not expected or could not be answered.
  */
 static int _applemidi_sync(struct MIDIDriverAppleMIDI *driver, struct sock *sk,
 			   struct AppleMIDICommand *command)
 {
+	struct RTPPeer *peer;
+	struct RTPPeerSync *sync;
 	unsigned long ssrc;
-	MIDITimestamp timestamp, diff;
+	MIDITimestamp timestamp = command->timestamp, departure;
+	long long offset, delay;
+	int result = 0;
+
 	RTPSessionGetSSRC(driver->rtp_session, &ssrc);
-	MIDIClockGetNow(driver->base.clock, &timestamp);
-	pr_debug("got timestamp %lld\n", timestamp);
-	if (command->type != APPLEMIDI_COMMAND_SYNCHRONIZATION ||
-	    command->data.sync.ssrc == ssrc || command->data.sync.count > 2) {
-		command->type = APPLEMIDI_COMMAND_SYNCHRONIZATION;
-		command->data.sync.ssrc = ssrc;
-		command->data.sync.count = 0;
-		command->data.sync.timestamp1 = timestamp;
+	pr_debug("arrived at %lld\n", timestamp);
+	trace_applemidi_sync(command->data.sync.ssrc, command->data.sync.count,
+			     command->data.sync.timestamp1,
+			     command->data.sync.timestamp2,
+			     command->data.sync.timestamp3, timestamp);
+
+	peer = _applemidi_get_peer(driver, command->data.sync.ssrc);
+	if (peer == NULL) {
+		pr_debug("sync from unknown peer %lu\n",
+			 command->data.sync.ssrc);
+		return 1;
+	}
+	sync = RTPPeerGetSync(peer);
 
-		driver->sync = 1;
-		return _applemidi_send_command(driver, sk, command);
-	} else {
-		RTPSessionFindPeerBySSRC(driver->rtp_session, &(driver->peer),
-					 command->data.sync.ssrc);
-
-		/* received packet from other peer */
-		if (command->data.sync.count == 2) {
-			/* compute media delay */
-			diff = (command->data.sync.timestamp3 -
-				command->data.sync.timestamp1) /
-			       2;
-			/* approximate time difference between peer and self */
-			diff = command->data.sync.timestamp3 + diff - timestamp;
-
-			/* RTPPeerSetTimestampDiff( command->peer, diff ) */
-			/* finished sync */
-			command->data.sync.ssrc = ssrc;
-			command->data.sync.count = 3;
-
-			driver->sync = 0;
-			return 0;
-		}
-		if (command->data.sync.count == 1) {
-			/* compute media delay */
-			diff = (command->data.sync.timestamp3 -
-				command->data.sync.timestamp1) /
-			       2;
-			/* approximate time difference between peer and self */
-			diff = command->data.sync.timestamp2 + diff - timestamp;
-
-			/* RTPPeerSetTimestampDiff( command->peer, diff ) */
-
-			command->data.sync.ssrc = ssrc;
-			command->data.sync.count = 2;
-			command->data.sync.timestamp3 = timestamp;
-
-			driver->sync = 0;
-			return _applemidi_send_command(driver, sk, command);
+	switch (command->data.sync.count) {
+	case 0:
+		/* the peer starts an exchange */
+		command->data.sync.ssrc = ssrc;
+		command->data.sync.count = 1;
+		command->data.sync.timestamp2 = timestamp;
+		result = _applemidi_send_command(driver, sk, command);
+		break;
+	case 1:
+		/* answer to our CK 0; ignore it if it is late or unknown */
+		if (!sync->pending ||
+		    command->data.sync.timestamp1 != sync->timestamp1) {
+			result = 1;
+			break;
 		}
-		if (command->data.sync.count == 0) {
-			command->data.sync.ssrc = ssrc;
-			command->data.sync.count = 1;
-			command->data.sync.timestamp2 = timestamp;
+		delay = (timestamp - (long long)command->data.sync.timestamp1) / 2;
+		offset = (long long)command->data.sync.timestamp2 -
+			 ((long long)command->data.sync.timestamp1 + delay);
+		_applemidi_sync_done(driver, peer, offset, delay, timestamp);
 
-			driver->sync = 2;
-			return _applemidi_send_command(driver, sk, command);
-		}
+		command->data.sync.ssrc = ssrc;
+		command->data.sync.count = 2;
+		MIDIClockGetNow(driver->base.clock, &departure);
+		command->data.sync.timestamp3 = departure;
+		result = _applemidi_send_command(driver, sk, command);
+		break;
+	case 2:
+		/* the peer completed an exchange it started */
+		delay = ((long long)command->data.sync.timestamp3 -
+			 (long long)command->data.sync.timestamp1) / 2;
+		offset = ((long long)command->data.sync.timestamp1 + delay) -
+			 (long long)command->data.sync.timestamp2;
+		_applemidi_sync_done(driver, peer, offset, delay, timestamp);
+		break;
+	default:
+		result = 1;
+		break;
 	}
-	return 1;
+
+	RTPPeerRelease(peer);
+	return result;
 }
 
+/**
+ * @brief Start a synchronization exchange with a peer.
+ * Send CK 0 and remember its timestamp, so the answer can be matched.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param peer The peer.
+ * @retval 0 On success.
+ * @retval >0 If the command could not be sent.
+ */
 static int _applemidi_start_sync(struct MIDIDriverAppleMIDI *driver,
-				 struct sock *sk, int size,
-				 struct sockaddr_in *addr)
+				 struct RTPPeer *peer)
 {
-	if (addr != &(driver->command.addr))
-		memcpy(&(driver->command.addr), addr, size);
-	driver->command.size = size;
-	driver->command.type = APPLEMIDI_COMMAND_SYNCHRONIZATION;
-	driver->command.data.sync.count = 3;
-	RTPSessionGetSSRC(driver->rtp_session,
-			  &(driver->command.data.sync.ssrc));
+	struct RTPPeerSync *sync = RTPPeerGetSync(peer);
+	struct AppleMIDICommand command;
+	struct sockaddr_in *addr;
+	MIDITimestamp timestamp;
+	int size;
+
+	if (RTPPeerGetAddress(peer, &size, &addr))
+		return 1;
+
+	memset(&command, 0, sizeof(command));
+	memcpy(&(command.addr), addr, size);
+	command.size = size;
+	command.type = APPLEMIDI_COMMAND_SYNCHRONIZATION;
+	RTPSessionGetSSRC(driver->rtp_session, &(command.data.sync.ssrc));
+	MIDIClockGetNow(driver->base.clock, &timestamp);
+	command.data.sync.count = 0;
+	command.data.sync.timestamp1 = timestamp;
+
+	sync->pending = 1;
+	sync->timestamp1 = timestamp;
+	sync->deadline = ktime_add_ms(ktime_get(), APPLEMIDI_SYNC_TIMEOUT);
 
-	return _applemidi_sync(driver, sk, &(driver->command));
+	pr_debug("start sync with client: %pI4\n", &addr->sin_addr.s_addr);
+	return _applemidi_send_command(driver, driver->rtp_socket->sk,
+				       &command);
+}
+
+/**
+ * @brief Add the peer of an invitation to the RTP session.
+ * An invitation from a peer which is already part of the session is
+ * accepted again. A peer at the same address with another SSRC was
+ * restarted and is replaced.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param command The invitation.
+ * @retval 0 On success.
+ * @retval >0 If the peer could not be added.
+ */
+static int _applemidi_add_peer(struct MIDIDriverAppleMIDI *driver,
+			       struct AppleMIDICommand *command)
+{
+	struct RTPPeer *peer, *old = NULL;
+	int result;
+
+	peer = RTPPeerCreate(command->data.session.ssrc, command->size,
+			     (struct sockaddr_in *)&(command->addr));
+	if (peer == NULL)
+		return 1;
+	RTPPeerGetSync(peer)->interval = APPLEMIDI_SYNC_INTERVAL_MIN;
+
+	if (RTPSessionFindPeerBySSRC(driver->rtp_session, &old,
+				     command->data.session.ssrc) == 0) {
+		RTPPeerRelease(old);
+		result = 0;
+	} else {
+		if (RTPSessionFindPeerByAddress(driver->rtp_session, &old,
+						&(command->addr)) == 0) {
+			RTPSessionRemovePeer(driver->rtp_session, old);
+			RTPPeerRelease(old);
+		}
+		result = RTPSessionAddPeer(driver->rtp_session, peer);
+	}
+	RTPPeerRelease(peer);
+
+	/* sync rapidly with the new peer */
+	if (result == 0)
+		queue_work(driver->workqueue, &driver->sync_work);
+	return result;
 }
 
 /**
@@ -362,13 +631,10 @@ static int _applemidi_respond(struct MIDIDriverAppleMIDI *driver,
 		}
 		if (driver->accept) {
 			command->type = APPLEMIDI_COMMAND_INVITATION_ACCEPTED;
-			if (sk == driver->rtp_socket->sk) {
-				peer = RTPPeerCreate(
-				    command->data.session.ssrc, command->size,
-				    (struct sockaddr_in *)&(command->addr));
-				RTPSessionAddPeer(driver->rtp_session, peer);
-				RTPPeerRelease(peer);
-			}
+			if (sk == driver->rtp_socket->sk &&
+			    _applemidi_add_peer(driver, command))
+				command->type =
+				    APPLEMIDI_COMMAND_INVITATION_REJECTED;
 		} else {
 			command->type = APPLEMIDI_COMMAND_INVITATION_REJECTED;
 		}
@@ -391,6 +657,7 @@ static int _applemidi_respond(struct MIDIDriverAppleMIDI *driver,
 		// MIDIEventRelease( event );
 		if (peer != NULL) {
 			RTPSessionRemovePeer(driver->rtp_session, peer);
+			RTPPeerRelease(peer);
 		}
 		break;
 	case APPLEMIDI_COMMAND_SYNCHRONIZATION:
@@ -407,12 +674,29 @@ static int _applemidi_respond(struct MIDIDriverAppleMIDI *driver,
 	return 0;
 }
 
-static int _test_applemidi(u16 *buf, int len)
+/**
+ * @brief Check if a datagram is an AppleMIDI command.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param skb The datagram.
+ * @retval 0 If the datagram is an AppleMIDI command.
+ * @retval >0 If it is something else, i.e. RTP MIDI on the rtp port.
+ * @retval <0 If the datagram is malformed.
+ */
+static int _test_applemidi(struct sk_buff *skb)
 {
-	if (len < 4)
+	const struct udphdr *uh;
+	const struct applemidi_header *hdr;
+	struct udphdr _uh;
+	struct applemidi_header _hdr;
+	int offset, len;
+
+	if (_applemidi_udp_payload(skb, &offset, &len, &uh, &_uh)
+	    || len < sizeof(_hdr))
 		return -1;
-	if (ntohs(buf[0]) == APPLEMIDI_PROTOCOL_SIGNATURE) {
-		switch (ntohs(buf[1])) {
+
+	hdr = skb_header_pointer(skb, offset, sizeof(_hdr), &_hdr);
+	if (hdr != NULL && ntohs(hdr->signature) == APPLEMIDI_PROTOCOL_SIGNATURE) {
+		switch (ntohs(hdr->command)) {
 		case APPLEMIDI_COMMAND_INVITATION:
 		case APPLEMIDI_COMMAND_INVITATION_ACCEPTED:
 		case APPLEMIDI_COMMAND_INVITATION_REJECTED:
@@ -426,60 +710,256 @@ static int _test_applemidi(u16 *buf, int len)
 }
 
 /**
- * @brief Receive Packets from Socket
- * This callback is called from the network stack
+ * @brief Queue a received control packet.
+ * The packet is processed by the control work in the order of arrival.
+ * The socket is remembered in the control block of the skb, so the control
+ * work knows where to reply.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param sk The socket the packet was received on.
+ * @param skb The datagram.
+ * @retval 0 On success.
+ * @retval >0 If the queue is full or the driver is being destroyed.
+ */
+static int _applemidi_queue_control(struct MIDIDriverAppleMIDI *driver,
+				    struct sock *sk, struct sk_buff *skb)
+{
+	unsigned long flags;
+	int result = 1;
+
+	APPLEMIDI_SKB_CB(skb)->sk = sk;
+
+	spin_lock_irqsave(&driver->control_queue.lock, flags);
+	if (!driver->stopping &&
+	    skb_queue_len(&driver->control_queue) < APPLEMIDI_CONTROL_QUEUE_LEN) {
+		__skb_queue_tail(&driver->control_queue, skb);
+		queue_work(driver->workqueue, &driver->control_work);
+		result = 0;
+	} else {
+		driver->control_dropped++;
+	}
+	spin_unlock_irqrestore(&driver->control_queue.lock, flags);
+	return result;
+}
+
+/**
+ * @brief Schedule the receive work.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ */
+static void _applemidi_rx_schedule(struct MIDIDriverAppleMIDI *driver)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&driver->control_queue.lock, flags);
+	if (!driver->stopping)
+		queue_work_on(driver->rx_cpu, driver->rx_workqueue,
+			      &driver->rx_work);
+	spin_unlock_irqrestore(&driver->control_queue.lock, flags);
+}
+
+/**
+ * @brief Obtain the arrival time of a datagram.
+ * The socket timestamp is taken when the packet enters the network stack,
+ * by the network card if it supports it. It is in the realtime clock, so
+ * its age is subtracted from the current time of the MIDI clock, which
+ * counts monotonic time. If there is no timestamp, or the realtime clock
+ * was set meanwhile, the current time is used.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param skb The datagram.
+ * @return the arrival time in ticks of the MIDI clock.
+ */
+static MIDITimestamp _applemidi_rx_timestamp(struct MIDIDriverAppleMIDI *driver,
+					     struct sk_buff *skb)
+{
+	struct skb_shared_hwtstamps *hwtstamps = skb_hwtstamps(skb);
+	ktime_t stamp = skb->tstamp;
+	MIDITimestamp now;
+	s64 age;
+
+	MIDIClockGetNow(driver->base.clock, &now);
+
+	/* hardware timestamp transformed into system time */
+	if (hwtstamps->syststamp.tv64 != 0)
+		stamp = hwtstamps->syststamp;
+	if (stamp.tv64 == 0)
+		return now;
+
+	age = ktime_to_ns(ktime_sub(ktime_get_real(), stamp));
+	if (age < 0 || age > NSEC_PER_SEC)
+		return now;
+	return now - div_s64(age * APPLEMIDI_CLOCK_RATE, NSEC_PER_SEC);
+}
+
+/**
+ * @brief Receive an AppleMIDI command at UDP demux.
+ * Called by the UDP layer in softirq context for every datagram to one of
+ * our sockets, before it is queued on the socket. AppleMIDI commands are
+ * consumed and queued for the control work; everything else takes the
+ * normal way to the receive queue of the socket.
  * @private @memberof MIDIDriverAppleMIDI
  * @param sk The socket.
- * @param bytes The number of bytes received.
+ * @param skb The datagram, starting with the UDP header.
+ * @retval 0 If the datagram was consumed.
+ * @retval >0 If the datagram should be processed by UDP.
  */
+static int _applemidi_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	struct MIDIDriverAppleMIDI *driver = sk->sk_user_data;
+
+	if (driver == NULL || _test_applemidi(skb) != 0)
+		return 1;
+
+	/* UDP only verifies the checksum after the encap hook */
+	if (udp_lib_checksum_complete(skb)) {
+		kfree_skb(skb);
+		return 0;
+	}
+
+	pr_debug("is applemidi message\n");
+	APPLEMIDI_SKB_CB(skb)->timestamp = _applemidi_rx_timestamp(driver, skb);
+	if (_applemidi_queue_control(driver, sk, skb) != 0) {
+		pr_warn_ratelimited("dropped control packet, queue full "
+				    "(%lu dropped)\n", driver->control_dropped);
+		kfree_skb(skb);
+	}
+	return 0;
+}
 
+/**
+ * @brief Wake the receive work.
+ * This callback is called from the network stack in softirq context for
+ * datagrams which are no AppleMIDI commands, so it only schedules the
+ * receive work.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param sk The socket.
+ * @param bytes The number of bytes received.
+ */
 static void _socket_callback(struct sock *sk, int bytes)
 {
-	struct MIDIDriverAppleMIDI *driver = raspi; // should NOT be global
+	struct MIDIDriverAppleMIDI *driver = sk->sk_user_data;
 
-	int len = 0;
-	int length;
-	u16 *l;
+	if (driver != NULL)
+		_applemidi_rx_schedule(driver);
+}
 
-	struct sk_buff *skb;
+/**
+ * @brief Handle a received datagram.
+ * AppleMIDI commands were already taken by _applemidi_encap_rcv, so this
+ * is RTP MIDI or something unknown.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param sk The socket the datagram was received on.
+ * @param skb The datagram; it is consumed.
+ */
+static void _applemidi_rx(struct MIDIDriverAppleMIDI *driver, struct sock *sk,
+			  struct sk_buff *skb)
+{
+	if (driver->rtp_socket->sk == sk) {
+		// handle incomming midi
+		//_applemidi_receive_rtpmidi( driver );
+	}
 
-	pr_debug("received %d bytes\n", bytes);
-
-	len = skb_queue_len(&sk->sk_receive_queue);
-	while (len > 0) {
-		skb = skb_dequeue(&sk->sk_receive_queue);
-
-		l = (u16 *)(skb->data + 4);
-		length = ntohs(*l);
-		if (length >= (8 + 4)) {
-			if (_test_applemidi((u16 *)(skb->data + 8),
-					    length - 8) == 0) {
-				pr_debug("is applemidi message\n");
-				// test if possible now:
-				if (spin_trylock(&(driver->lock))) {
-					pr_debug("allowed (lock not taken)\n");
-					if (_applemidi_recv_command(
-						driver, skb,
-						&(driver->command)) == 0) {
-						pr_debug("reply to command\n");
-						_applemidi_respond(
-						    driver, sk,
-						    &(driver->command));
-					}
-					spin_unlock(&(driver->lock));
-				} else {
-					pr_warn("dropped packet because of "
-						"sending note\n");
-				}
-			} else if (driver->rtp_socket->sk == sk) {
-				// handle incomming midi
-				//_applemidi_receive_rtpmidi( driver );
-			}
+	kfree_skb(skb);
+}
+
+/**
+ * @brief Receive Packets from the Sockets
+ * Drain the receive queues of both sockets, at most APPLEMIDI_RX_BATCH
+ * datagrams of each per run. If packets are left, the work is queued again,
+ * so other work on the CPU gets its turn.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param work The receive work of the driver.
+ */
+static void _applemidi_rx_work(struct work_struct *work)
+{
+	struct MIDIDriverAppleMIDI *driver =
+	    container_of(work, struct MIDIDriverAppleMIDI, rx_work);
+	struct socket *sockets[] = { driver->control_socket,
+				     driver->rtp_socket };
+	struct sk_buff *skb;
+	struct sock *sk;
+	int i, n, more = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sockets); i++) {
+		if (sockets[i] == NULL)
+			continue;
+		sk = sockets[i]->sk;
+
+		for (n = 0; n < APPLEMIDI_RX_BATCH; n++) {
+			skb = skb_dequeue(&sk->sk_receive_queue);
+			if (skb == NULL)
+				break;
+			_applemidi_rx(driver, sk, skb);
 		}
+		if (!skb_queue_empty(&sk->sk_receive_queue))
+			more = 1;
+	}
+
+	if (more)
+		_applemidi_rx_schedule(driver);
+}
+
+/**
+ * @brief Process the queued control packets.
+ * Runs on the driver's workqueue, so replies can be sent and peers can be
+ * allocated without holding the send lock.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param work The control work of the driver.
+ */
+static void _applemidi_control_work(struct work_struct *work)
+{
+	struct MIDIDriverAppleMIDI *driver =
+	    container_of(work, struct MIDIDriverAppleMIDI, control_work);
+	struct sk_buff *skb;
 
-		len--;
+	mutex_lock(&driver->session_mutex);
+	while ((skb = skb_dequeue(&driver->control_queue)) != NULL) {
+		if (_applemidi_recv_command(driver, skb, &(driver->command)) ==
+		    0) {
+			pr_debug("reply to command\n");
+			_applemidi_respond(driver, APPLEMIDI_SKB_CB(skb)->sk,
+					   &(driver->command));
+		}
 		kfree_skb(skb);
 	}
+	mutex_unlock(&driver->session_mutex);
+}
+
+/**
+ * @brief Hook the driver into a bound socket.
+ * AppleMIDI commands are taken at UDP demux by the encap hook, the
+ * remaining datagrams wake the receive work. Timestamping is enabled to
+ * time the sync commands.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param driver The driver.
+ * @param sock The socket.
+ */
+static void _applemidi_setup_socket(struct MIDIDriverAppleMIDI *driver,
+				    struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+	int timestamping = SOF_TIMESTAMPING_RX_HARDWARE |
+			   SOF_TIMESTAMPING_SYS_HARDWARE |
+			   SOF_TIMESTAMPING_RX_SOFTWARE |
+			   SOF_TIMESTAMPING_SOFTWARE;
+	int one = 1;
+
+	sk->sk_user_data = driver;
+	sk->sk_data_ready = _socket_callback;
+
+	/* Timestamp received packets, in hardware if possible. */
+	if (kernel_setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
+			      (char *)&timestamping, sizeof(timestamping)) &&
+	    kernel_setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&one,
+			      sizeof(one)))
+		pr_warn("could not enable timestamping\n");
+
+	/* Mark the socket as an encapsulation socket. */
+	udp_sk(sk)->encap_type = APPLEMIDI_UDP_ENCAP;
+	udp_sk(sk)->encap_rcv = _applemidi_encap_rcv;
+	udp_encap_enable();
 }
 
 static int _applemidi_connect(struct MIDIDriverAppleMIDI *driver)
@@ -506,8 +986,6 @@ static int _applemidi_connect(struct MIDIDriverAppleMIDI *driver)
 			goto control_fail;
 		}
 
-		driver->control_socket->sk->sk_data_ready = _socket_callback;
-
 		pr_debug("control ready\n");
 	}
 	if (driver->rtp_socket == NULL) {
@@ -518,6 +996,7 @@ static int _applemidi_connect(struct MIDIDriverAppleMIDI *driver)
 		if (sock_create(PF_INET, SOCK_DGRAM, IPPROTO_UDP,
 				&driver->rtp_socket) < 0) {
 			pr_err(KERN_ERR "server: Error creating datasocket\n");
+			result = -EIO;
 			goto control_fail;
 		}
 		result = driver->control_socket->ops->bind(
@@ -526,7 +1005,6 @@ static int _applemidi_connect(struct MIDIDriverAppleMIDI *driver)
 			goto rtp_fail;
 		}
 
-		driver->rtp_socket->sk->sk_data_ready = _socket_callback;
 		pr_debug("rtp ready\n");
 	}
 
@@ -578,13 +1056,12 @@ static int _applemidi_disconnect_peer(struct MIDIDriverAppleMIDI *driver,
 static int _applemidi_disconnect(struct MIDIDriverAppleMIDI *driver,
 				 struct socket *sock)
 {
-	struct RTPPeer *peer = NULL;
-	RTPSessionNextPeer(driver->rtp_session, &peer);
-	while (peer != NULL) {
+	struct RTPPeer *peer;
+
+	/* the peer is removed, so always continue with the new first */
+	while ((peer = _applemidi_next_peer(driver, NULL)) != NULL) {
 		_applemidi_disconnect_peer(driver, peer);
-		peer = NULL;
-		/* peer was removed, find the new first*/
-		RTPSessionNextPeer(driver->rtp_session, &peer);
+		RTPPeerRelease(peer);
 	}
 
 	if (sock == driver->control_socket || sock == NULL) {
@@ -604,44 +1081,78 @@ static int _applemidi_disconnect(struct MIDIDriverAppleMIDI *driver,
 	return 0;
 }
 
-void _applemidi_idle_timeout(unsigned long data)
+/**
+ * @brief Synchronize with the peers.
+ * Queued by the sync timer. Every peer has its own exchange: it is started
+ * when the peer is due, and CK 0 is sent again if the answer does not
+ * arrive in time. After APPLEMIDI_SYNC_RETRIES the exchange is given up
+ * and the interval is tightened. Finally the timer is set to the earliest
+ * event of all peers.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param work The sync work of the driver.
+ */
+static void _applemidi_sync_work(struct work_struct *work)
 {
-	struct sockaddr_in *addr;
-	int size;
-
-	struct MIDIDriverAppleMIDI *driver = (struct MIDIDriverAppleMIDI *)data;
-	mod_timer(&driver->timer, jiffies + msecs_to_jiffies(1500));
-
-	pr_debug("====called timeout (%ld) dat: %lx ====\n", jiffies, data);
-
-	if (spin_trylock(&(driver->lock))) {
-		RTPSessionNextPeer(driver->rtp_session, &(driver->peer));
-		if (driver->peer != NULL) {
-			/* check if receiver feedback needs to be sent */
-			if (driver->sync == 0) {
-				/* no sync packets active. start new sync */
-				RTPPeerGetAddress(driver->peer, &size, &addr);
-
-				pr_debug("start sync with client: %pI4\n",
-					 &addr->sin_addr.s_addr);
-				_applemidi_start_sync(
-				    driver, driver->rtp_socket->sk, size, addr);
-				// no return
+	struct MIDIDriverAppleMIDI *driver =
+	    container_of(work, struct MIDIDriverAppleMIDI, sync_work);
+	struct RTPPeer *peer = NULL;
+	struct RTPPeerSync *sync;
+	ktime_t now, event, wakeup = ktime_set(KTIME_SEC_MAX, 0);
+	unsigned long flags;
+	int armed = 0;
+
+	mutex_lock(&driver->session_mutex);
+	while ((peer = _applemidi_next_peer(driver, peer)) != NULL) {
+		sync = RTPPeerGetSync(peer);
+		if (sync->interval == 0)
+			sync->interval = APPLEMIDI_SYNC_INTERVAL_MIN;
+		now = ktime_get();
+
+		if (sync->pending &&
+		    ktime_to_ns(now) >= ktime_to_ns(sync->deadline)) {
+			if (sync->retries < APPLEMIDI_SYNC_RETRIES) {
+				sync->retries++;
+				_applemidi_start_sync(driver, peer);
+			} else {
+				pr_debug("sync timed out\n");
+				_applemidi_sync_adapt(driver, peer, 0);
+				sync->pending = 0;
+				sync->retries = 0;
+				sync->next = ktime_add_ms(now, sync->interval);
 			}
+		} else if (!sync->pending &&
+			   ktime_to_ns(now) >= ktime_to_ns(sync->next)) {
+			_applemidi_start_sync(driver, peer);
 		}
-		spin_unlock(&(driver->lock));
-	} else {
-		pr_warn("could not so sync timeout because of midi event\n");
+
+		event = sync->pending ? sync->deadline : sync->next;
+		if (ktime_to_ns(event) < ktime_to_ns(wakeup))
+			wakeup = event;
+		armed = 1;
 	}
-	//
-	// /* check for messages in dispatch (incoming) queue:
-	//  *   if message needs to be dispatched (timestamp >= now+latency)
-	//  *   call MIDIDriverAppleMIDIReceiveMessage
-	//  * send receiver feedback
-	//  * if the last synchronization happened a certain time ago,
-	// synchronize again */
-	//
-	// return 0;
+	mutex_unlock(&driver->session_mutex);
+
+	spin_lock_irqsave(&driver->control_queue.lock, flags);
+	if (armed && !driver->stopping)
+		hrtimer_start_range_ns(&driver->sync_timer, wakeup,
+				       APPLEMIDI_SYNC_SLACK * NSEC_PER_MSEC,
+				       HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&driver->control_queue.lock, flags);
+}
+
+/**
+ * @brief Queue the sync work.
+ * @private @memberof MIDIDriverAppleMIDI
+ * @param timer The sync timer of the driver.
+ * @return @c HRTIMER_NORESTART, the sync work sets the timer again.
+ */
+static enum hrtimer_restart _applemidi_sync_timeout(struct hrtimer *timer)
+{
+	struct MIDIDriverAppleMIDI *driver =
+	    container_of(timer, struct MIDIDriverAppleMIDI, sync_timer);
+
+	queue_work(driver->workqueue, &driver->sync_work);
+	return HRTIMER_NORESTART;
 }
 
 /**
@@ -657,39 +1168,76 @@ struct MIDIDriverAppleMIDI *MIDIDriverAppleMIDICreate(char *name,
 	struct MIDIDriverAppleMIDI *driver;
 	MIDITimestamp timestamp;
 
-	driver = kmalloc(sizeof(struct MIDIDriverAppleMIDI), GFP_KERNEL);
+	driver = kzalloc(sizeof(struct MIDIDriverAppleMIDI), GFP_KERNEL);
 	if (driver == NULL) {
 		return NULL;
 	}
 	pr_debug("placed driver at %p\n", driver);
 
-	spin_lock_init(&(driver->lock));
+	spin_lock_init(&(driver->send_lock));
+	mutex_init(&(driver->session_mutex));
+	skb_queue_head_init(&(driver->control_queue));
+	INIT_WORK(&(driver->control_work), _applemidi_control_work);
+	INIT_WORK(&(driver->sync_work), _applemidi_sync_work);
+	driver->stopping = 0;
+	driver->control_dropped = 0;
+
+	INIT_WORK(&(driver->rx_work), _applemidi_rx_work);
+
+	driver->rx_cpu = WORK_CPU_UNBOUND;
+	if (rx_cpu >= 0) {
+		if (rx_cpu < nr_cpu_ids && cpu_online(rx_cpu))
+			driver->rx_cpu = rx_cpu;
+		else
+			pr_warn("cpu %d is not online, receiving on any cpu\n",
+				rx_cpu);
+	}
+
+	hrtimer_init(&driver->sync_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	driver->sync_timer.function = _applemidi_sync_timeout;
+
+	driver->workqueue = alloc_ordered_workqueue("applemidi", 0);
+	if (driver->workqueue == NULL)
+		goto fail;
+	driver->rx_workqueue = alloc_workqueue("applemidi_rx", WQ_HIGHPRI, 0);
+	if (driver->rx_workqueue == NULL)
+		goto fail;
 
 	pr_debug("allocated driver structure\n");
-	MIDIDriverInit(&(driver->base), name, APPLEMIDI_CLOCK_RATE,
-		       (void *)driver);
 
 	driver->control_socket = NULL;
 	driver->rtp_socket = NULL;
 	driver->port = port;
 	driver->accept = 0xff;
-	driver->sync = 0;
 	strncpy(&(driver->name[0]), name, sizeof(driver->name));
 	driver->name[31] = 0;
 
+	memset(&(driver->command), 0, sizeof(driver->command));
+
+	driver->command.peer = NULL;
+
 	// driver->in_queue = MIDIMessageQueueCreate();
 	// driver->out_queue = MIDIMessageQueueCreate();
 
 	// driver->base.send = &_driver_send;
 	// driver->base.destroy = &_driver_destroy;
 
-	_applemidi_connect(driver);
+	/* the sockets do not receive anything until they are set up below */
+	if (_applemidi_connect(driver))
+		goto fail;
 
 	pr_debug("connected sockets\n");
 
-	driver->peer = NULL;
 	driver->rtp_session = RTPSessionCreate(driver->rtp_socket);
+	if (driver->rtp_session == NULL)
+		goto fail;
 	driver->rtpmidi_session = RTPMIDISessionCreate(driver->rtp_session);
+	if (driver->rtpmidi_session == NULL)
+		goto fail;
+
+	/* registers the ALSA client, which sends over the sessions */
+	MIDIDriverInit(&(driver->base), name, APPLEMIDI_CLOCK_RATE,
+		       (void *)driver);
 
 	MIDIClockGetNow(driver->base.clock, &timestamp);
 
@@ -697,16 +1245,27 @@ struct MIDIDriverAppleMIDI *MIDIDriverAppleMIDICreate(char *name,
 
 	driver->token = timestamp;
 
-	memset(&(driver->command), 0, sizeof(driver->command));
-
-	driver->command.peer = NULL;
-
-	setup_timer(&driver->timer, _applemidi_idle_timeout,
-		    (unsigned long)driver);
-
-	mod_timer(&driver->timer, jiffies + msecs_to_jiffies(5000));
+	/* everything is set up, so packets may arrive from here on */
+	_applemidi_setup_socket(driver, driver->control_socket);
+	_applemidi_setup_socket(driver, driver->rtp_socket);
 
 	return driver;
+
+fail:
+	if (driver->rtpmidi_session != NULL)
+		RTPMIDISessionRelease(driver->rtpmidi_session);
+	if (driver->rtp_session != NULL)
+		RTPSessionRelease(driver->rtp_session);
+	if (driver->rtp_socket != NULL)
+		sock_release(driver->rtp_socket);
+	if (driver->control_socket != NULL)
+		sock_release(driver->control_socket);
+	if (driver->rx_workqueue != NULL)
+		destroy_workqueue(driver->rx_workqueue);
+	if (driver->workqueue != NULL)
+		destroy_workqueue(driver->workqueue);
+	kfree(driver);
+	return NULL;
 }
 
 /**
@@ -717,13 +1276,24 @@ struct MIDIDriverAppleMIDI *MIDIDriverAppleMIDICreate(char *name,
  */
 void MIDIDriverAppleMIDIDestroy(struct MIDIDriverAppleMIDI *driver)
 {
+	unsigned long flags;
+
+	/* no packets are received or queued and no syncs started from here on */
+	spin_lock_irqsave(&driver->control_queue.lock, flags);
+	driver->stopping = 1;
+	spin_unlock_irqrestore(&driver->control_queue.lock, flags);
+	hrtimer_cancel(&driver->sync_timer);
+	destroy_workqueue(driver->rx_workqueue);
+	destroy_workqueue(driver->workqueue);
+	hrtimer_cancel(&driver->sync_timer);
+	skb_queue_purge(&driver->control_queue);
+
 	_applemidi_disconnect(driver, NULL);
 	RTPMIDISessionRelease(driver->rtpmidi_session);
 	RTPSessionRelease(driver->rtp_session);
 	// MIDIMessageQueueRelease(driver->in_queue);
 	// MIDIMessageQueueRelease(driver->out_queue);
 	MIDIDriverRelease(&(driver->base));
-	del_timer(&driver->timer);
 	kfree(driver);
 }
 
@@ -742,6 +1312,8 @@ static void __exit mod_exit(void)
 	if (raspi) {
 		MIDIDriverAppleMIDIDestroy(raspi);
 	}
+	/* the peers are freed after a grace period */
+	rcu_barrier();
 	pr_info("leaving applemidi\n");
 }
 
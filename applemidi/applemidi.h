@@ -3,11 +3,41 @@
 
 #include <net/sock.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/skbuff.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
 
 #include "midi.h"
 
 #define APPLEMIDI_PROTOCOL_SIGNATURE 0xffff
 
+/* Number of received control packets waiting to be processed. */
+#define APPLEMIDI_CONTROL_QUEUE_LEN 64
+/* Number of datagrams taken from each socket per run of the receive work. */
+#define APPLEMIDI_RX_BATCH 16
+
+/*
+ * Limits of the time between two sync exchanges with a peer in ms. A new
+ * peer is synced APPLEMIDI_SYNC_FAST_COUNT times with the minimum, then
+ * the interval doubles while the clock estimate is stable and halves when
+ * it is not.
+ */
+#define APPLEMIDI_SYNC_INTERVAL_MIN 250
+#define APPLEMIDI_SYNC_INTERVAL_MAX 30000
+#define APPLEMIDI_SYNC_FAST_COUNT 6
+/*
+ * The estimate is stable while the error of the prediction, the jitter of
+ * the delay and the drift over the next interval stay below this, in ticks
+ * of APPLEMIDI_CLOCK_RATE.
+ */
+#define APPLEMIDI_SYNC_STABLE 10
+/* Slack of the sync timer in ms, so wakeups can be coalesced. */
+#define APPLEMIDI_SYNC_SLACK 10
+/* Time to wait for the answer to CK 0 in ms. */
+#define APPLEMIDI_SYNC_TIMEOUT 500
+#define APPLEMIDI_SYNC_RETRIES 3
+
 /* "IN" on control & rtp port */
 #define APPLEMIDI_COMMAND_INVITATION 0x494e
 /* "NO" on control & rtp port */
@@ -21,6 +51,40 @@
 /* "RS" on control port */
 #define APPLEMIDI_COMMAND_RECEIVER_FEEDBACK 0x5253
 
+/* Wire format of the AppleMIDI commands, all fields in network byte order. */
+struct applemidi_header
+{
+	__be16 signature;
+	__be16 command;
+};
+
+/* IN, NO, OK and BY; followed by the optional, zero terminated name */
+struct applemidi_session
+{
+	struct applemidi_header header;
+	__be32 version;
+	__be32 token;
+	__be32 ssrc;
+};
+
+/* CK; the timestamps are 64 bit values split into high and low word */
+struct applemidi_sync
+{
+	struct applemidi_header header;
+	__be32 ssrc;
+	u8 count;
+	u8 padding[3];
+	__be32 timestamps[6];
+};
+
+/* RS */
+struct applemidi_feedback
+{
+	struct applemidi_header header;
+	__be32 ssrc;
+	__be32 seqnum;
+};
+
 struct AppleMIDICommand
 {
 	struct RTPPeer *peer; /* use peers sockaddr instead .. we get
@@ -29,6 +93,7 @@ struct AppleMIDICommand
 	int size;
 	/* unsigned short channel; */
 	unsigned short type;
+	MIDITimestamp timestamp; /* arrival time of a received command */
 	union
 	{
 		struct
@@ -56,21 +121,42 @@ struct AppleMIDICommand
 
 struct MIDIDriverAppleMIDI
 {
-	spinlock_t lock;
+	/*
+	 * Taken to send notes; protects the encoding buffers of the sessions
+	 * and the send state and clock estimate of the peers. The peers
+	 * themselves are managed by the RTP session under RCU.
+	 * Taken with spin_lock_bh, never with interrupts disabled, since the
+	 * packets are transmitted under it.
+	 */
+	spinlock_t send_lock;
+	/* Protects the session state, i.e. command and the peer sync states. */
+	struct mutex session_mutex;
+	/* Runs control_work and sync_work in order. */
+	struct workqueue_struct *workqueue;
+	/* Received control packets, processed by control_work. */
+	struct sk_buff_head control_queue;
+	struct work_struct control_work;
+	struct work_struct sync_work;
+	/* Drains the sockets, runs on rx_cpu. */
+	struct workqueue_struct *rx_workqueue;
+	struct work_struct rx_work;
+	int rx_cpu;
+	/* Set under the control_queue lock when the driver is destroyed. */
+	unsigned char stopping;
+	unsigned long control_dropped;
 	struct MIDIDriver base;
 	struct socket *control_socket;
 	struct socket *rtp_socket;
 	unsigned short port;
 	unsigned char accept;
-	unsigned char sync;
 	unsigned long token;
 	char name[32];
 
-	struct timer_list timer;
+	/* Fires at the next sync event of any peer and queues sync_work. */
+	struct hrtimer sync_timer;
 
 	struct AppleMIDICommand command;
 
-	struct RTPPeer *peer;
 	struct RTPSession *rtp_session;
 	struct RTPMIDISession *rtpmidi_session;
 
@@ -0,0 +1,143 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM applemidi
+
+#if !defined(_APPLEMIDI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _APPLEMIDI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the AppleMIDI send path and session management.
+ * Enable them with ftrace or perf, e.g.:
+ *   echo 1 > /sys/kernel/debug/tracing/events/applemidi/enable
+ */
+
+TRACE_EVENT(applemidi_alsa_input,
+	    TP_PROTO(int type, unsigned char channel, unsigned char note,
+		     unsigned char velocity),
+	    TP_ARGS(type, channel, note, velocity),
+	    TP_STRUCT__entry(__field(int, type)
+			     __field(unsigned char, channel)
+			     __field(unsigned char, note)
+			     __field(unsigned char, velocity)),
+	    TP_fast_assign(__entry->type = type;
+			   __entry->channel = channel;
+			   __entry->note = note;
+			   __entry->velocity = velocity;),
+	    TP_printk("type=%d channel=%u note=%u velocity=%u", __entry->type,
+		      __entry->channel, __entry->note, __entry->velocity)
+);
+
+TRACE_EVENT(rtpmidi_encode,
+	    TP_PROTO(long long timestamp, size_t size),
+	    TP_ARGS(timestamp, size),
+	    TP_STRUCT__entry(__field(long long, timestamp)
+			     __field(size_t, size)),
+	    TP_fast_assign(__entry->timestamp = timestamp;
+			   __entry->size = size;),
+	    TP_printk("ts=%lld size=%zu", __entry->timestamp, __entry->size)
+);
+
+TRACE_EVENT(rtp_send,
+	    TP_PROTO(unsigned long ssrc, __be32 addr, __be16 port,
+		     unsigned short seqnum, unsigned long timestamp,
+		     size_t size, int result),
+	    TP_ARGS(ssrc, addr, port, seqnum, timestamp, size, result),
+	    TP_STRUCT__entry(__field(unsigned long, ssrc)
+			     __field(__be32, addr)
+			     __field(__be16, port)
+			     __field(unsigned short, seqnum)
+			     __field(unsigned long, timestamp)
+			     __field(size_t, size)
+			     __field(int, result)),
+	    TP_fast_assign(__entry->ssrc = ssrc;
+			   __entry->addr = addr;
+			   __entry->port = port;
+			   __entry->seqnum = seqnum;
+			   __entry->timestamp = timestamp;
+			   __entry->size = size;
+			   __entry->result = result;),
+	    TP_printk("ssrc=%lu to=%pI4:%u seq=%u ts=%lu size=%zu result=%d",
+		      __entry->ssrc, &__entry->addr, ntohs(__entry->port),
+		      __entry->seqnum, __entry->timestamp, __entry->size,
+		      __entry->result)
+);
+
+TRACE_EVENT(rtp_clock,
+	    TP_PROTO(unsigned long ssrc, long long sample_offset,
+		     long long sample_delay, long long offset, long long delay,
+		     long long drift, bool accepted),
+	    TP_ARGS(ssrc, sample_offset, sample_delay, offset, delay, drift,
+		    accepted),
+	    TP_STRUCT__entry(__field(unsigned long, ssrc)
+			     __field(long long, sample_offset)
+			     __field(long long, sample_delay)
+			     __field(long long, offset)
+			     __field(long long, delay)
+			     __field(long long, drift)
+			     __field(bool, accepted)),
+	    TP_fast_assign(__entry->ssrc = ssrc;
+			   __entry->sample_offset = sample_offset;
+			   __entry->sample_delay = sample_delay;
+			   __entry->offset = offset;
+			   __entry->delay = delay;
+			   __entry->drift = drift;
+			   __entry->accepted = accepted;),
+	    TP_printk("ssrc=%lu sample=%lld/%lld %s offset=%lld delay=%lld "
+		      "drift=%lldppm",
+		      __entry->ssrc, __entry->sample_offset,
+		      __entry->sample_delay,
+		      __entry->accepted ? "accepted" : "rejected",
+		      __entry->offset, __entry->delay, __entry->drift)
+);
+
+TRACE_EVENT(applemidi_command,
+	    TP_PROTO(bool sent, unsigned short type, unsigned long ssrc,
+		     __be32 addr, __be16 port),
+	    TP_ARGS(sent, type, ssrc, addr, port),
+	    TP_STRUCT__entry(__field(bool, sent)
+			     __field(unsigned short, type)
+			     __field(unsigned long, ssrc)
+			     __field(__be32, addr)
+			     __field(__be16, port)),
+	    TP_fast_assign(__entry->sent = sent;
+			   __entry->type = type;
+			   __entry->ssrc = ssrc;
+			   __entry->addr = addr;
+			   __entry->port = port;),
+	    TP_printk("%s %c%c ssrc=%lu peer=%pI4:%u",
+		      __entry->sent ? "sent" : "received",
+		      __entry->type >> 8, __entry->type & 0xff, __entry->ssrc,
+		      &__entry->addr, ntohs(__entry->port))
+);
+
+TRACE_EVENT(applemidi_sync,
+	    TP_PROTO(unsigned long ssrc, unsigned long count,
+		     unsigned long long timestamp1,
+		     unsigned long long timestamp2,
+		     unsigned long long timestamp3, long long now),
+	    TP_ARGS(ssrc, count, timestamp1, timestamp2, timestamp3, now),
+	    TP_STRUCT__entry(__field(unsigned long, ssrc)
+			     __field(unsigned long, count)
+			     __field(unsigned long long, timestamp1)
+			     __field(unsigned long long, timestamp2)
+			     __field(unsigned long long, timestamp3)
+			     __field(long long, now)),
+	    TP_fast_assign(__entry->ssrc = ssrc;
+			   __entry->count = count;
+			   __entry->timestamp1 = timestamp1;
+			   __entry->timestamp2 = timestamp2;
+			   __entry->timestamp3 = timestamp3;
+			   __entry->now = now;),
+	    TP_printk("ssrc=%lu count=%lu t1=%llu t2=%llu t3=%llu now=%lld",
+		      __entry->ssrc, __entry->count, __entry->timestamp1,
+		      __entry->timestamp2, __entry->timestamp3, __entry->now)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE applemidi_trace
+#include <trace/define_trace.h>
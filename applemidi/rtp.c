@@ -1,11 +1,34 @@
 #include <net/sock.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/ip.h>
+#include <net/route.h>
+#include <net/checksum.h>
 
 #include "rtp.h"
+#include "applemidi_trace.h"
 
-#define RTP_MAX_PEERS 16
+/*
+ * The peers are indexed by SSRC and by address in hash tables of
+ * 1 << hash_bits buckets. The tables grow when there are more peers than
+ * buckets, up to 1 << RTP_HASH_MAX_BITS buckets.
+ */
+#define RTP_HASH_MIN_BITS 4
+#define RTP_HASH_MAX_BITS 12
 #define RTP_BUF_LEN 512
 #define RTP_IOV_LEN 16
+/* room for the UDP, IP and link layer headers in front of a packet */
+#define RTP_HEADROOM \
+	(MAX_HEADER + sizeof(struct iphdr) + sizeof(struct udphdr))
 
 struct RTPAddress
 {
@@ -14,15 +37,68 @@ struct RTPAddress
 	struct sockaddr_in addr;
 };
 
+/*
+ * Clock estimation: the offset samples of the last RTP_CLOCK_SAMPLES sync
+ * exchanges are kept. A sample whose delay exceeds RTP_CLOCK_REJECT times
+ * the minimum of the window (plus RTP_CLOCK_SLACK ticks) was queued
+ * somewhere and is not used. The accepted samples update the estimate with
+ * an alpha-beta filter: the offset is predicted with the drift and corrected
+ * by 1/RTP_CLOCK_GAIN of the error, the drift is measured over
+ * RTP_CLOCK_SAMPLES accepted samples and smoothed the same way.
+ */
+#define RTP_CLOCK_SAMPLES 8
+#define RTP_CLOCK_REJECT 2
+#define RTP_CLOCK_SLACK 5
+#define RTP_CLOCK_GAIN 4
+#define RTP_CLOCK_PPM 1000000
+
+struct RTPClockSample
+{
+	long long offset;
+	long long delay;
+	long long time;
+};
+
+struct RTPClock
+{
+	struct RTPClockSample samples[RTP_CLOCK_SAMPLES];
+	unsigned long count; /* number of samples taken */
+	unsigned long accepted; /* number of samples used */
+	long long offset; /* filtered offset at time */
+	long long delay; /* filtered one way delay */
+	long long drift; /* of the offset, in parts per million */
+	long long error; /* of the last accepted sample against the prediction */
+	long long jitter; /* filtered deviation of the delay */
+	long long time;
+	long long ref_offset; /* start of the drift measurement */
+	long long ref_time;
+};
+
 struct RTPPeer
 {
-	size_t refs;
+	struct kref kref;
+	struct rcu_head rcu;
 	struct RTPAddress address;
 	unsigned long in_timestamp;
 	unsigned long out_timestamp;
 	unsigned long in_seqnum;
 	unsigned long out_seqnum;
+	struct RTPPeerSync sync;
+	struct RTPClock clock;
 	void *info;
+
+	/* route to the address, cached under the lock of the session */
+	struct rtable *route;
+	__be32 saddr;
+
+	/*
+	 * Membership of one session. The list is read under RCU, the hash
+	 * nodes and linked are changed under the lock of the session.
+	 */
+	struct list_head list;
+	struct hlist_node ssrc_node;
+	struct hlist_node addr_node;
+	unsigned char linked;
 };
 
 struct RTPSession
@@ -32,7 +108,13 @@ struct RTPSession
 	struct socket *socket;
 
 	struct RTPAddress self;
-	struct RTPPeer *peers[RTP_MAX_PEERS];
+	/* serializes changes of the peers; the list is read under RCU */
+	spinlock_t lock;
+	struct list_head peers;
+	struct hlist_head *ssrc_hash;
+	struct hlist_head *addr_hash;
+	unsigned int hash_bits;
+	unsigned int num_peers;
 	struct RTPPacketInfo info;
 
 	struct iovec iov[RTP_IOV_LEN];
@@ -68,7 +150,9 @@ struct RTPPeer *RTPPeerCreate(unsigned long ssrc, int size,
 			      struct sockaddr_in *addr)
 {
 	struct RTPPeer *peer = kmalloc(sizeof(struct RTPPeer), GFP_KERNEL);
-	peer->refs = 1;
+	if (peer == NULL)
+		return NULL;
+	kref_init(&(peer->kref));
 	peer->address.ssrc = ssrc;
 	peer->address.size = size;
 	memcpy(&(peer->address.addr), addr, sizeof(struct sockaddr_in));
@@ -79,6 +163,15 @@ struct RTPPeer *RTPPeerCreate(unsigned long ssrc, int size,
 	peer->in_timestamp = 0;
 	peer->out_seqnum = 0;
 	peer->out_timestamp = 0;
+	memset(&(peer->sync), 0, sizeof(peer->sync));
+	memset(&(peer->clock), 0, sizeof(peer->clock));
+	INIT_LIST_HEAD(&(peer->list));
+	INIT_HLIST_NODE(&(peer->ssrc_node));
+	INIT_HLIST_NODE(&(peer->addr_node));
+	peer->linked = 0;
+	peer->route = NULL;
+	peer->saddr = 0;
+	peer->sync.next = ktime_get();
 	peer->info = NULL;
 	return peer;
 }
@@ -91,7 +184,45 @@ struct RTPPeer *RTPPeerCreate(unsigned long ssrc, int size,
  */
 void RTPPeerRetain(struct RTPPeer *peer)
 {
-	peer->refs++;
+	kref_get(&(peer->kref));
+}
+
+/**
+ * @brief Retain an RTPPeer instance found under RCU.
+ * A peer found in the list of a session under rcu_read_lock may already be
+ * released by the session, so it can only be retained if it is still in
+ * use.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @retval 0 on success.
+ * @retval >0 if the peer is about to be destroyed.
+ */
+int RTPPeerTryRetain(struct RTPPeer *peer)
+{
+	return kref_get_unless_zero(&(peer->kref)) ? 0 : 1;
+}
+
+static void _peer_free(struct rcu_head *head)
+{
+	struct RTPPeer *peer = container_of(head, struct RTPPeer, rcu);
+
+	if (peer->route != NULL)
+		ip_rt_put(peer->route);
+	kfree(peer);
+}
+
+/**
+ * @brief Check whether a peer is still in the list of its session.
+ * The next pointer of a peer removed before the current RCU read section
+ * may be stale, so it must not be used to continue a walk.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @retval 1 if the peer is in the list.
+ * @retval 0 if the peer was removed.
+ */
+int RTPPeerIsLinked(struct RTPPeer *peer)
+{
+	return ACCESS_ONCE(peer->linked);
 }
 
 /**
@@ -102,7 +233,13 @@ void RTPPeerRetain(struct RTPPeer *peer)
  */
 void RTPPeerDestroy(struct RTPPeer *peer)
 {
-	kfree(peer);
+	/* readers of the peer list may still see the peer and its route */
+	call_rcu(&(peer->rcu), _peer_free);
+}
+
+static void _peer_release(struct kref *kref)
+{
+	RTPPeerDestroy(container_of(kref, struct RTPPeer, kref));
 }
 
 /**
@@ -114,9 +251,7 @@ void RTPPeerDestroy(struct RTPPeer *peer)
  */
 void RTPPeerRelease(struct RTPPeer *peer)
 {
-	if (!--peer->refs) {
-		RTPPeerDestroy(peer);
-	}
+	kref_put(&(peer->kref), _peer_release);
 }
 
 /**
@@ -138,6 +273,147 @@ int RTPPeerGetAddress(struct RTPPeer *peer, int *size,
 	return 0;
 }
 
+/**
+ * @brief Obtain the clock synchronization state of the peer.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @return a pointer to the synchronization state.
+ */
+struct RTPPeerSync *RTPPeerGetSync(struct RTPPeer *peer)
+{
+	return &(peer->sync);
+}
+
+/**
+ * @brief Add the result of a sync exchange to the clock estimate.
+ * The caller has to serialize this with RTPPeerGetClock.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @param offset The clock of the peer minus the own clock.
+ * @param delay The one way delay.
+ * @param time The own time of the sample.
+ * @retval 0 if the sample was used.
+ * @retval >0 if the sample was rejected because of its delay.
+ */
+int RTPPeerAddClockSample(struct RTPPeer *peer, long long offset,
+			  long long delay, long long time)
+{
+	struct RTPClock *clock = &(peer->clock);
+	struct RTPClockSample *sample;
+	long long min_delay, predicted, drift;
+	int i, n;
+
+	if (delay < 0)
+		return 1;
+
+	sample = &(clock->samples[clock->count % RTP_CLOCK_SAMPLES]);
+	sample->offset = offset;
+	sample->delay = delay;
+	sample->time = time;
+	clock->count++;
+
+	n = min_t(unsigned long, clock->count, RTP_CLOCK_SAMPLES);
+	min_delay = delay;
+	for (i = 0; i < n; i++)
+		if (clock->samples[i].delay < min_delay)
+			min_delay = clock->samples[i].delay;
+
+	if (delay > RTP_CLOCK_REJECT * min_delay + RTP_CLOCK_SLACK) {
+		clock->jitter += (delay - clock->delay - clock->jitter) /
+				 RTP_CLOCK_GAIN;
+		trace_rtp_clock(peer->address.ssrc, offset, delay, clock->offset,
+				clock->delay, clock->drift, false);
+		return 1;
+	}
+
+	if (clock->accepted == 0) {
+		clock->offset = offset;
+		clock->delay = delay;
+		clock->ref_offset = offset;
+		clock->ref_time = time;
+	} else {
+		predicted = clock->offset +
+			    div64_s64(clock->drift * (time - clock->time),
+				      RTP_CLOCK_PPM);
+		clock->error = offset > predicted ? offset - predicted
+						  : predicted - offset;
+		clock->jitter += ((delay > clock->delay ? delay - clock->delay
+							: clock->delay - delay) -
+				  clock->jitter) / RTP_CLOCK_GAIN;
+		clock->offset = predicted + (offset - predicted) / RTP_CLOCK_GAIN;
+		clock->delay += (delay - clock->delay) / RTP_CLOCK_GAIN;
+	}
+	clock->time = time;
+	clock->accepted++;
+
+	if (clock->accepted % RTP_CLOCK_SAMPLES == 0 && time > clock->ref_time) {
+		drift = div64_s64((clock->offset - clock->ref_offset) *
+				      RTP_CLOCK_PPM,
+				  time - clock->ref_time);
+		if (clock->accepted == RTP_CLOCK_SAMPLES)
+			clock->drift = drift;
+		else
+			clock->drift += (drift - clock->drift) / RTP_CLOCK_GAIN;
+		clock->ref_offset = clock->offset;
+		clock->ref_time = time;
+	}
+
+	trace_rtp_clock(peer->address.ssrc, offset, delay, clock->offset,
+			clock->delay, clock->drift, true);
+	return 0;
+}
+
+/**
+ * @brief Obtain the estimated clock of the peer.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @param time The own time to get the offset for.
+ * @param offset The clock of the peer minus the own clock at @c time.
+ * @param delay The one way delay, may be @c NULL.
+ * @param drift The drift of the offset in parts per million, may be
+ * @c NULL.
+ * @retval 0 on success.
+ * @retval >0 if there is no estimate yet.
+ */
+int RTPPeerGetClock(struct RTPPeer *peer, long long time, long long *offset,
+		    long long *delay, long long *drift)
+{
+	struct RTPClock *clock = &(peer->clock);
+
+	if (clock->accepted == 0 || offset == NULL)
+		return 1;
+	*offset = clock->offset +
+		  div64_s64(clock->drift * (time - clock->time), RTP_CLOCK_PPM);
+	if (delay != NULL)
+		*delay = clock->delay;
+	if (drift != NULL)
+		*drift = clock->drift;
+	return 0;
+}
+
+/**
+ * @brief Obtain the quality of the clock estimate.
+ * @public @memberof RTPPeer
+ * @param peer The peer.
+ * @param error The deviation of the last accepted sample from the
+ * predicted offset.
+ * @param jitter The filtered deviation of the delay from its estimate,
+ * including rejected samples.
+ * @retval 0 on success.
+ * @retval >0 if there is no estimate yet.
+ */
+int RTPPeerGetClockQuality(struct RTPPeer *peer, long long *error,
+			   long long *jitter)
+{
+	struct RTPClock *clock = &(peer->clock);
+
+	if (clock->accepted == 0 || error == NULL || jitter == NULL)
+		return 1;
+	*error = clock->error;
+	*jitter = clock->jitter;
+	return 0;
+}
+
 /**
  * @brief Create an RTPSession instance.
  * Allocate space and initialize an RTPSession instance.
@@ -151,12 +427,25 @@ struct RTPSession *RTPSessionCreate(struct socket *sock)
 	struct RTPSession *session =
 	    kmalloc(sizeof(struct RTPSession), GFP_KERNEL);
 	int i;
+	if (session == NULL)
+		return NULL;
 	session->refs = 1;
 	session->socket = sock;
 
 	_init_addr_with_socket(&(session->self), sock);
-	for (i = 0; i < RTP_MAX_PEERS; i++) {
-		session->peers[i] = NULL;
+	spin_lock_init(&(session->lock));
+	INIT_LIST_HEAD(&(session->peers));
+	session->num_peers = 0;
+	session->hash_bits = RTP_HASH_MIN_BITS;
+	session->ssrc_hash = kcalloc(1 << session->hash_bits,
+				     sizeof(struct hlist_head), GFP_KERNEL);
+	session->addr_hash = kcalloc(1 << session->hash_bits,
+				     sizeof(struct hlist_head), GFP_KERNEL);
+	if (session->ssrc_hash == NULL || session->addr_hash == NULL) {
+		kfree(session->ssrc_hash);
+		kfree(session->addr_hash);
+		kfree(session);
+		return NULL;
 	}
 
 	session->buflen = RTP_BUF_LEN;
@@ -194,12 +483,14 @@ struct RTPSession *RTPSessionCreate(struct socket *sock)
  */
 void RTPSessionDestroy(struct RTPSession *session)
 {
-	int i;
-	for (i = 0; i < RTP_MAX_PEERS; i++) {
-		if (session->peers[i] != NULL) {
-			RTPPeerRelease(session->peers[i]);
-		}
+	struct RTPPeer *peer, *next;
+	list_for_each_entry_safe(peer, next, &(session->peers), list) {
+		list_del_rcu(&(peer->list));
+		peer->linked = 0;
+		RTPPeerRelease(peer);
 	}
+	kfree(session->ssrc_hash);
+	kfree(session->addr_hash);
 	kfree(session->buffer);
 	kfree(session);
 }
@@ -222,10 +513,65 @@ void RTPSessionRelease(struct RTPSession *session)
 	}
 }
 
+static struct hlist_head *_session_ssrc_bucket(struct hlist_head *hash,
+						unsigned int bits,
+						unsigned long ssrc)
+{
+	return &hash[hash_32(ssrc, bits)];
+}
+
+static struct hlist_head *_session_addr_bucket(struct hlist_head *hash,
+						unsigned int bits,
+						struct sockaddr_in *addr)
+{
+	return &hash[hash_32(jhash_2words(addr->sin_addr.s_addr,
+					  addr->sin_port, 0),
+			     bits)];
+}
+
+/**
+ * @brief Resize the hash tables of the session.
+ * This is called with the session locked, so the tables are allocated
+ * atomically. If that fails, the old tables are kept; they still work,
+ * only with longer chains. Unlike the list, the tables are only read
+ * under the lock, so their nodes can simply be moved.
+ * @private @memberof RTPSession
+ * @param session The session.
+ * @param bits The new number of hash bits.
+ */
+static void _session_rehash(struct RTPSession *session, unsigned int bits)
+{
+	struct hlist_head *ssrc_hash, *addr_hash;
+	struct RTPPeer *peer;
+
+	ssrc_hash = kcalloc(1 << bits, sizeof(struct hlist_head), GFP_ATOMIC);
+	addr_hash = kcalloc(1 << bits, sizeof(struct hlist_head), GFP_ATOMIC);
+	if (ssrc_hash == NULL || addr_hash == NULL) {
+		kfree(ssrc_hash);
+		kfree(addr_hash);
+		return;
+	}
+
+	list_for_each_entry(peer, &(session->peers), list) {
+		hlist_add_head(&(peer->ssrc_node),
+			       _session_ssrc_bucket(ssrc_hash, bits,
+						    peer->address.ssrc));
+		hlist_add_head(&(peer->addr_node),
+			       _session_addr_bucket(addr_hash, bits,
+						    &(peer->address.addr)));
+	}
+
+	kfree(session->ssrc_hash);
+	kfree(session->addr_hash);
+	session->ssrc_hash = ssrc_hash;
+	session->addr_hash = addr_hash;
+	session->hash_bits = bits;
+}
+
 /**
  * @brief Add an RTPPeer to the session.
- * Lookup the peer using the (pseudo) hash-table, add it to the list and retain
- * it.
+ * Add the peer to the list and the hash tables and retain it. A peer can
+ * be part of one session only.
  * The peer will be included when data is sent via RTPSessionSendPayload.
  * @public @memberof RTPSession
  * @param session The session.
@@ -235,23 +581,39 @@ void RTPSessionRelease(struct RTPSession *session)
  */
 int RTPSessionAddPeer(struct RTPSession *session, struct RTPPeer *peer)
 {
-	int i, off, p;
-	off = peer->address.ssrc % RTP_MAX_PEERS;
-	for (i = 0; i < RTP_MAX_PEERS; i++) {
-		p = (i + off) % RTP_MAX_PEERS;
-		if (session->peers[p] == NULL) {
-			session->peers[p] = peer;
-			RTPPeerRetain(peer);
-			return 0;
-		}
+	unsigned long flags;
+
+	spin_lock_irqsave(&(session->lock), flags);
+	if (peer->linked) {
+		spin_unlock_irqrestore(&(session->lock), flags);
+		return 1;
 	}
-	return 1;
+
+	if (session->num_peers >= (1 << session->hash_bits) &&
+	    session->hash_bits < RTP_HASH_MAX_BITS)
+		_session_rehash(session, session->hash_bits + 1);
+
+	RTPPeerRetain(peer);
+	hlist_add_head(&(peer->ssrc_node),
+		       _session_ssrc_bucket(session->ssrc_hash,
+					    session->hash_bits,
+					    peer->address.ssrc));
+	hlist_add_head(&(peer->addr_node),
+		       _session_addr_bucket(session->addr_hash,
+					    session->hash_bits,
+					    &(peer->address.addr)));
+	peer->linked = 1;
+	session->num_peers++;
+	/* publish the initialized peer */
+	list_add_tail_rcu(&(peer->list), &(session->peers));
+	spin_unlock_irqrestore(&(session->lock), flags);
+	return 0;
 }
 
 /**
  * @brief Remove an RTPPeer from the session.
- * Lookup the peer using the (pseudo) hash-table, remove it from the list and
- * release it.
+ * Remove the peer from the list and the hash tables and release it. Readers
+ * of the list may still see it until the end of their RCU read section.
  * @public @memberof RTPSession
  * @param session The session.
  * @param peer The peer to remove.
@@ -260,17 +622,23 @@ int RTPSessionAddPeer(struct RTPSession *session, struct RTPPeer *peer)
  */
 int RTPSessionRemovePeer(struct RTPSession *session, struct RTPPeer *peer)
 {
-	int i, off, p;
-	off = peer->address.ssrc % RTP_MAX_PEERS;
-	for (i = 0; i < RTP_MAX_PEERS; i++) {
-		p = (i + off) % RTP_MAX_PEERS;
-		if (session->peers[p] == peer) {
-			session->peers[p] = NULL;
-			RTPPeerRelease(peer);
-			return 0;
-		}
+	unsigned long flags;
+
+	spin_lock_irqsave(&(session->lock), flags);
+	if (!peer->linked) {
+		spin_unlock_irqrestore(&(session->lock), flags);
+		return 1;
 	}
-	return 1;
+
+	list_del_rcu(&(peer->list));
+	hlist_del_init(&(peer->ssrc_node));
+	hlist_del_init(&(peer->addr_node));
+	peer->linked = 0;
+	session->num_peers--;
+	spin_unlock_irqrestore(&(session->lock), flags);
+
+	RTPPeerRelease(peer);
+	return 0;
 }
 
 int RTPSessionGetSSRC(struct RTPSession *session, unsigned long *ssrc)
@@ -285,36 +653,31 @@ int RTPSessionGetSSRC(struct RTPSession *session, unsigned long *ssrc)
  * @brief Advance the pointer to the next peer.
  * Given a @c NULL pointer the first peer will be returned. When the
  * last peer was reached a @c NULL pointer will be returned.
+ * The caller has to hold rcu_read_lock, and the given peer has to be found
+ * in the same read section: a peer removed in the meantime still leads to
+ * the rest of the list then. To continue from a peer retained across read
+ * sections, check RTPPeerIsLinked first.
  * @public @memberof RTPSession
  * @param session The session.
  * @param peer The peer.
  * @retval 0 on success.
- * @retval >0 if the given peer does not exist.
+ * @retval >0 if no peer pointer was given.
  */
 int RTPSessionNextPeer(struct RTPSession *session, struct RTPPeer **peer)
 {
-	int i;
+	struct list_head *next;
 	if (peer == NULL)
 		return 1;
 	if (*peer == NULL) {
-		i = -1;
+		next = rcu_dereference(list_next_rcu(&(session->peers)));
 	} else {
-		for (i = 0; i < RTP_MAX_PEERS; i++) {
-			if (session->peers[i] == *peer) {
-				break;
-			}
-		}
-		if (i == RTP_MAX_PEERS)
-			return 1;
+		next = rcu_dereference(list_next_rcu(&((*peer)->list)));
 	}
 
-	do {
-		i++;
-	} while (i < RTP_MAX_PEERS && session->peers[i] == NULL);
-	if (i == RTP_MAX_PEERS) {
+	if (next == &(session->peers)) {
 		*peer = NULL;
 	} else {
-		*peer = session->peers[i];
+		*peer = list_entry(next, struct RTPPeer, list);
 	}
 	return 0;
 }
@@ -323,7 +686,7 @@ int RTPSessionNextPeer(struct RTPSession *session, struct RTPPeer **peer)
  * Retrieve peer information by looking up the given SSRC identifier.
  * @public @memberof RTPSession
  * @param session The session.
- * @param peer The peer.
+ * @param peer The peer; it is retained and has to be released.
  * @param ssrc The SSRC.
  * @retval 0 on success.
  * @retval >0 if no peer with the given ssrc was found.
@@ -331,18 +694,55 @@ int RTPSessionNextPeer(struct RTPSession *session, struct RTPPeer **peer)
 int RTPSessionFindPeerBySSRC(struct RTPSession *session, struct RTPPeer **peer,
 			     unsigned long ssrc)
 {
-	int i, off, p;
-	off = ssrc % RTP_MAX_PEERS;
-	for (i = 0; i < RTP_MAX_PEERS; i++) {
-		p = (i + off) % RTP_MAX_PEERS;
-		if (session->peers[p] != NULL) {
-			if (session->peers[p]->address.ssrc == ssrc) {
-				*peer = session->peers[p];
-				return 0;
-			}
+	struct RTPPeer *p;
+	unsigned long flags;
+	int result = 1;
+
+	spin_lock_irqsave(&(session->lock), flags);
+	hlist_for_each_entry(p, _session_ssrc_bucket(session->ssrc_hash,
+						     session->hash_bits, ssrc),
+			     ssrc_node) {
+		if (p->address.ssrc == ssrc) {
+			RTPPeerRetain(p);
+			*peer = p;
+			result = 0;
+			break;
 		}
 	}
-	return 1;
+	spin_unlock_irqrestore(&(session->lock), flags);
+	return result;
+}
+
+/**
+ * Retrieve peer information by looking up the given address and port.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param peer The peer; it is retained and has to be released.
+ * @param addr The address.
+ * @retval 0 on success.
+ * @retval >0 if no peer with the given address was found.
+ */
+int RTPSessionFindPeerByAddress(struct RTPSession *session,
+				struct RTPPeer **peer, struct sockaddr_in *addr)
+{
+	struct RTPPeer *p;
+	unsigned long flags;
+	int result = 1;
+
+	spin_lock_irqsave(&(session->lock), flags);
+	hlist_for_each_entry(p, _session_addr_bucket(session->addr_hash,
+						     session->hash_bits, addr),
+			     addr_node) {
+		if (p->address.addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    p->address.addr.sin_port == addr->sin_port) {
+			RTPPeerRetain(p);
+			*peer = p;
+			result = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&(session->lock), flags);
+	return result;
 }
 
 static int _rtp_encode_header(struct RTPPacketInfo *info, size_t size,
@@ -468,8 +868,9 @@ int RTPSessionSendPacket(struct RTPSession *session, struct RTPPacketInfo *info)
 
 	mm_segment_t oldfs;
 
-	// debug:
+#ifdef DEBUG
 	int i, j;
+#endif
 
 	pr_debug("RTP send message\n");
 
@@ -511,6 +912,7 @@ int RTPSessionSendPacket(struct RTPSession *session, struct RTPPacketInfo *info)
 
 	pr_debug("RTP Sending RTP message consisting of %i iovecs.\n",
 		 (int)iovlen);
+#ifdef DEBUG
 	for (i = 0; i < iovlen; i++) {
 		pr_debug("[%i] iov_len: %i, iov_base: %p\n", i,
 			 (int)iov[i].iov_len, iov[i].iov_base);
@@ -524,6 +926,7 @@ int RTPSessionSendPacket(struct RTPSession *session, struct RTPPacketInfo *info)
 			}
 		}
 	}
+#endif
 
 	a = &(info->peer->address.addr);
 	pr_debug("send %i bytes to %pI4:%i on s(%p)\n", info->total_size,
@@ -543,6 +946,9 @@ int RTPSessionSendPacket(struct RTPSession *session, struct RTPPacketInfo *info)
 	set_fs(oldfs);
 
 	pr_debug("RTP bytes sent: %i of %i\n", bytes_sent, info->total_size);
+	trace_rtp_send(info->peer->address.ssrc, a->sin_addr.s_addr,
+		       a->sin_port, info->sequence_number, info->timestamp,
+		       info->total_size, bytes_sent);
 
 	if (bytes_sent != info->total_size) {
 		return bytes_sent;
@@ -554,3 +960,209 @@ int RTPSessionSendPacket(struct RTPSession *session, struct RTPPacketInfo *info)
 		return 0;
 	}
 }
+
+/**
+ * @brief Obtain the route to a peer.
+ * The route is cached in the peer and only looked up again when it became
+ * obsolete. The cache is changed under the lock of the session, so senders
+ * do not have to be serialized for it.
+ * @private @memberof RTPSession
+ * @param session The session.
+ * @param peer The peer.
+ * @param saddr The source address of the route.
+ * @return the route on success; it is referenced and has to be put.
+ * @return a @c NULL pointer if the peer is unreachable.
+ */
+static struct rtable *_session_route(struct RTPSession *session,
+				     struct RTPPeer *peer, __be32 *saddr)
+{
+	struct sock *sk = session->socket->sk;
+	struct inet_sock *inet = inet_sk(sk);
+	struct sockaddr_in *a = &(peer->address.addr);
+	struct rtable *rt;
+	struct flowi4 fl4;
+	unsigned long flags;
+
+	spin_lock_irqsave(&(session->lock), flags);
+	rt = peer->route;
+	if (rt != NULL && dst_check(&(rt->dst), 0) == NULL) {
+		ip_rt_put(rt);
+		rt = NULL;
+		peer->route = NULL;
+	}
+	if (rt == NULL) {
+		rt = ip_route_output_ports(sock_net(sk), &fl4, sk,
+					   a->sin_addr.s_addr,
+					   inet->inet_saddr, a->sin_port,
+					   inet->inet_sport, IPPROTO_UDP,
+					   RT_CONN_FLAGS(sk),
+					   sk->sk_bound_dev_if);
+		if (IS_ERR(rt)) {
+			rt = NULL;
+			goto unlock;
+		}
+		peer->route = rt;
+		peer->saddr = fl4.saddr;
+	}
+	dst_clone(&(rt->dst));
+	*saddr = peer->saddr;
+
+unlock:
+	spin_unlock_irqrestore(&(session->lock), flags);
+	return rt;
+}
+
+/**
+ * @brief Send a copy of a prepared RTP packet to a peer.
+ * Only the sequence number of the RTP header and the UDP and IP headers
+ * differ between the peers. The checksum of the rest of the packet is
+ * passed in @c csum.
+ * The send state of the peer is updated, so the sends of a session have to
+ * be serialized by the caller.
+ * @private @memberof RTPSession
+ * @param session The session.
+ * @param peer The peer.
+ * @param skb The RTP packet.
+ * @param header_size The size of the RTP header.
+ * @param csum The checksum of the packet after the RTP header.
+ * @param info The packet info.
+ * @retval 0 On success.
+ * @retval >0 If the packet could not be sent.
+ */
+static int _session_send_copy(struct RTPSession *session,
+			      struct RTPPeer *peer, struct sk_buff *skb,
+			      size_t header_size, __wsum csum,
+			      struct RTPPacketInfo *info)
+{
+	struct sock *sk = session->socket->sk;
+	struct sockaddr_in *a = &(peer->address.addr);
+	unsigned short seqnum = peer->out_seqnum + 1;
+	unsigned char *buffer;
+	struct sk_buff *copy;
+	struct udphdr *uh;
+	struct rtable *rt;
+	__be32 saddr;
+	int result;
+
+	rt = _session_route(session, peer, &saddr);
+	if (rt == NULL) {
+		result = -EHOSTUNREACH;
+		goto out;
+	}
+
+	/* the payload is a few bytes, a private copy is cheaper than
+	 * sharing it in a fragment */
+	copy = skb_copy(skb, GFP_ATOMIC);
+	if (copy == NULL) {
+		ip_rt_put(rt);
+		result = -ENOMEM;
+		goto out;
+	}
+
+	buffer = copy->data;
+	buffer[2] = (seqnum >> 8) & 0xff;
+	buffer[3] = seqnum & 0xff;
+
+	uh = (struct udphdr *)skb_push(copy, sizeof(struct udphdr));
+	skb_reset_transport_header(copy);
+	uh->source = inet_sk(sk)->inet_sport;
+	uh->dest = a->sin_port;
+	uh->len = htons(copy->len);
+	uh->check = 0;
+
+	csum = csum_partial(uh, sizeof(struct udphdr) + header_size, csum);
+	uh->check = csum_tcpudp_magic(saddr, a->sin_addr.s_addr, copy->len,
+				      IPPROTO_UDP, csum);
+	if (uh->check == 0)
+		uh->check = CSUM_MANGLED_0;
+	copy->ip_summed = CHECKSUM_NONE;
+
+	/* the packet takes over the reference of the route */
+	skb_dst_set(copy, &(rt->dst));
+	result = ip_build_and_send_pkt(copy, sk, saddr, a->sin_addr.s_addr,
+				       NULL);
+	result = net_xmit_eval(result);
+
+out:
+	pr_debug("send %i bytes to %pI4:%i: %i\n", (int)info->total_size,
+		 &a->sin_addr.s_addr, ntohs(a->sin_port), result);
+	trace_rtp_send(peer->address.ssrc, a->sin_addr.s_addr, a->sin_port,
+		       seqnum, info->timestamp, info->total_size,
+		       result ? result : info->total_size);
+
+	if (result != 0)
+		return 1;
+
+	peer->out_seqnum = seqnum;
+	peer->out_timestamp = info->timestamp;
+	return 0;
+}
+
+/**
+ * @brief Send an RTP packet to all peers of a session.
+ * The packet is built once. Each peer gets a copy in which only the
+ * sequence number and the destination differ, so sending to another peer
+ * costs far less than RTPSessionSendPacket.
+ * The sends of a session have to be serialized by the caller.
+ * @public @memberof RTPSession
+ * @param session The session.
+ * @param info The packet info. The peer is ignored, extensions are not
+ * supported.
+ * @retval 0 On success.
+ * @retval >0 If the packet could not be sent to all peers.
+ */
+int RTPSessionSendPayload(struct RTPSession *session,
+			  struct RTPPacketInfo *info)
+{
+	struct sk_buff *skb;
+	struct RTPPeer *peer;
+	size_t i, header_size, written = 0;
+	void *buffer;
+	__wsum csum;
+	int result = 0;
+
+	pr_debug("RTP send payload\n");
+
+	if (info == NULL || info->extension)
+		return 1;
+	if (info->iovlen > RTP_IOV_LEN)
+		return 1;
+
+	info->peer = NULL;
+	info->ssrc = session->self.ssrc;
+	info->sequence_number = 0; /* set for each peer */
+
+	info->payload_size = 0;
+	for (i = 0; i < info->iovlen; i++)
+		info->payload_size += info->iov[i].iov_len;
+	header_size = 12 + (info->csrc_count * 4);
+	info->total_size = header_size + info->payload_size + info->padding;
+
+	skb = alloc_skb(RTP_HEADROOM + info->total_size, GFP_ATOMIC);
+	if (skb == NULL)
+		return 1;
+	skb_reserve(skb, RTP_HEADROOM);
+
+	_rtp_encode_header(info, header_size, skb_put(skb, header_size),
+			   &written);
+	for (i = 0; i < info->iovlen; i++)
+		memcpy(skb_put(skb, info->iov[i].iov_len),
+		       info->iov[i].iov_base, info->iov[i].iov_len);
+	if (info->padding) {
+		buffer = skb_put(skb, info->padding);
+		memset(buffer, 0, info->padding);
+		_rtp_encode_padding(info, info->padding, buffer, &written);
+	}
+	csum = csum_partial(skb->data + header_size, skb->len - header_size, 0);
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(peer, &(session->peers), list) {
+		if (_session_send_copy(session, peer, skb, header_size, csum,
+				       info))
+			result = 1;
+	}
+	rcu_read_unlock();
+
+	consume_skb(skb);
+	return result;
+}
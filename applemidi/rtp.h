@@ -3,6 +3,7 @@
 
 #include <net/sock.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 
 struct RTPPacketInfo
 {
@@ -22,12 +23,36 @@ struct RTPPacketInfo
 	struct iovec *iov;
 };
 
+/**
+ * @brief State of the clock synchronization with a peer.
+ * The fields are maintained by the AppleMIDI session code.
+ */
+struct RTPPeerSync
+{
+	unsigned char pending; /* a CK 0 was sent and CK 1 is awaited */
+	unsigned char retries; /* times CK 0 was sent again */
+	ktime_t deadline; /* until CK 1 is awaited */
+	ktime_t next; /* time of the next exchange */
+	unsigned int interval; /* time between two exchanges in ms */
+	unsigned long long timestamp1; /* own timestamp of the pending CK 0 */
+	unsigned long count; /* number of completed exchanges */
+};
+
 struct RTPPeer *RTPPeerCreate(unsigned long ssrc, int size,
 			      struct sockaddr_in *addr);
 void RTPPeerRetain(struct RTPPeer *peer);
+int RTPPeerTryRetain(struct RTPPeer *peer);
+int RTPPeerIsLinked(struct RTPPeer *peer);
 void RTPPeerRelease(struct RTPPeer *peer);
 int RTPPeerGetAddress(struct RTPPeer *peer, int *size,
 		      struct sockaddr_in **addr);
+struct RTPPeerSync *RTPPeerGetSync(struct RTPPeer *peer);
+int RTPPeerAddClockSample(struct RTPPeer *peer, long long offset,
+			  long long delay, long long time);
+int RTPPeerGetClock(struct RTPPeer *peer, long long time, long long *offset,
+		    long long *delay, long long *drift);
+int RTPPeerGetClockQuality(struct RTPPeer *peer, long long *error,
+			   long long *jitter);
 
 struct RTPSession *RTPSessionCreate(struct socket *sock);
 void RTPSessionDestroy(struct RTPSession *session);
@@ -42,8 +67,12 @@ int RTPSessionNextPeer(struct RTPSession *session, struct RTPPeer **peer);
 
 int RTPSessionFindPeerBySSRC(struct RTPSession *session, struct RTPPeer **peer,
 			     unsigned long ssrc);
+int RTPSessionFindPeerByAddress(struct RTPSession *session,
+				struct RTPPeer **peer, struct sockaddr_in *addr);
 
 int RTPSessionSendPacket(struct RTPSession *session,
 			 struct RTPPacketInfo *info);
+int RTPSessionSendPayload(struct RTPSession *session,
+			  struct RTPPacketInfo *info);
 
 #endif
\ No newline at end of file
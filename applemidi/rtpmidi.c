@@ -1,5 +1,8 @@
+#include <linux/rcupdate.h>
+
 #include "rtp.h"
 #include "message.h"
+#include "applemidi_trace.h"
 
 struct RTPMIDIInfo
 {
@@ -271,6 +274,7 @@ int RTPMIDISessionSend(struct RTPMIDISession *session,
 
 	_rtpmidi_encode_messages(minfo, timestamp, messages, size, buffer,
 				 &written);
+	trace_rtpmidi_encode(timestamp, written);
 	iov[1].iov_base = buffer;
 	iov[1].iov_len = written;
 	_advance_buffer(&size, &buffer, written);
@@ -280,9 +284,22 @@ int RTPMIDISessionSend(struct RTPMIDISession *session,
 	iov[0].iov_len = written;
 	_advance_buffer(&size, &buffer, written);
 
+	info->iov = &(iov[0]);
+
+	/* without journals all peers get the same packet
+	 * it is built once and copied for each peer */
+	if (!minfo->journal) {
+		info->iovlen = 2;
+		return RTPSessionSendPayload(session->rtp_session, info);
+	}
+
 	/* send encoded messages to each peer
-	 * each peer has its own journal */
-	result = RTPSessionNextPeer(session->rtp_session, &peer);
+	 * each peer has its own journal
+	 * the peers are read under RCU, so changes of the session never
+	 * wait for a send */
+	rcu_read_lock();
+	if (RTPSessionNextPeer(session->rtp_session, &peer) != 0)
+		peer = NULL;
 	while (peer != NULL) {
 		// if( minfo->journal ) {
 		//  journal = NULL; /* peer out journal */
@@ -309,8 +326,10 @@ int RTPMIDISessionSend(struct RTPMIDISession *session,
 			// info->sequence_number, messages );
 		}
 
-		RTPSessionNextPeer(session->rtp_session, &peer);
+		if (RTPSessionNextPeer(session->rtp_session, &peer) != 0)
+			break;
 	}
+	rcu_read_unlock();
 
 	return result;
 }
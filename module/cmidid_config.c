@@ -0,0 +1,231 @@
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+
+#include "cmidid_util.h"
+#include "cmidid_config.h"
+
+/*
+ * cmidid_config_snapshot:
+ *
+ * An immutable copy of the configuration. The IRQ and timer handlers only
+ * ever see a complete snapshot; a change allocates a new one and swaps the
+ * pointer, the old one is freed after an RCU grace period.
+ *
+ * @rcu: used to defer freeing the snapshot until no reader can see it
+ * @cfg: the configuration values
+ */
+struct cmidid_config_snapshot {
+	struct rcu_head rcu;
+	struct cmidid_config cfg;
+};
+
+/*
+ * is_valid_config: Checks if the values of a configuration can be used
+ * by the hot path without further checks.
+ *
+ * @cfg: The configuration to check.
+ *
+ * Return: true if the configuration can be published; false otherwise
+ */
+static bool is_valid_config(const struct cmidid_config *cfg)
+{
+	if (cfg->version != CMIDID_CONFIG_VERSION) {
+		dbg("unsupported config version %u\n", cfg->version);
+		return false;
+	}
+	if (cfg->vel_curve > VEL_CURVE_SATURATED) {
+		dbg("unknown velocity curve %u\n", cfg->vel_curve);
+		return false;
+	}
+	if (cfg->stroke_time_min >= cfg->stroke_time_max) {
+		dbg("stroke_time_min %u not below stroke_time_max %u\n",
+		    cfg->stroke_time_min, cfg->stroke_time_max);
+		return false;
+	}
+	if (cfg->transpose < -127 || cfg->transpose > 127) {
+		dbg("transpose %d out of range\n", cfg->transpose);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * publish_config: Replaces the active configuration snapshot.
+ * The caller must hold `state->mutex'.
+ *
+ * @state: The configuration of the instance.
+ * @cfg: The new configuration. The generation counter is set here.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+static int publish_config(struct cmidid_config_state *state,
+			  struct cmidid_config *cfg)
+{
+	struct cmidid_config_snapshot *new, *old;
+
+	if (!is_valid_config(cfg))
+		return -EINVAL;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (new == NULL)
+		return -ENOMEM;
+
+	old = rcu_dereference_protected(state->active,
+					lockdep_is_held(&state->mutex));
+
+	cfg->generation = old ? old->cfg.generation + 1 : 0;
+	new->cfg = *cfg;
+
+	rcu_assign_pointer(state->active, new);
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+
+	dbg("config generation %u: curve %u, stroke time %u-%u, transpose %d\n",
+	    cfg->generation, cfg->vel_curve, cfg->stroke_time_min,
+	    cfg->stroke_time_max, cfg->transpose);
+
+	return 0;
+}
+
+/*
+ * cmidid_config_deref: Returns the active configuration snapshot.
+ * Must be called inside a rcu_read_lock()/rcu_read_unlock() section and the
+ * returned pointer must not be used after rcu_read_unlock().
+ *
+ * @state: The configuration of the instance.
+ *
+ * Return: The active configuration; never NULL after cmidid_config_init.
+ */
+const struct cmidid_config *cmidid_config_deref(struct cmidid_config_state
+						*state)
+{
+	return &rcu_dereference(state->active)->cfg;
+}
+
+/*
+ * cmidid_config_get: Copies the active configuration.
+ *
+ * @state: The configuration of the instance.
+ * @cfg: The location to copy the configuration to.
+ *
+ * Return: 0
+ */
+int cmidid_config_get(struct cmidid_config_state *state,
+		      struct cmidid_config *cfg)
+{
+	rcu_read_lock();
+	*cfg = *cmidid_config_deref(state);
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/*
+ * cmidid_config_check: Checks a configuration without publishing it, e.g.
+ * before changes which cannot be undone once it turns out to be invalid.
+ *
+ * @cfg: The configuration to check.
+ *
+ * Return: 0 if the configuration is valid; -EINVAL otherwise.
+ */
+int cmidid_config_check(const struct cmidid_config *cfg)
+{
+	return is_valid_config(cfg) ? 0 : -EINVAL;
+}
+
+/*
+ * cmidid_config_set: Atomically replaces the whole configuration.
+ *
+ * @state: The configuration of the instance.
+ * @cfg: The new configuration.
+ *
+ * Return: 0 on success; -EINVAL if the configuration is invalid.
+ */
+int cmidid_config_set(struct cmidid_config_state *state,
+		      const struct cmidid_config *cfg)
+{
+	struct cmidid_config new = *cfg;
+	int err;
+
+	mutex_lock(&state->mutex);
+	err = publish_config(state, &new);
+	mutex_unlock(&state->mutex);
+
+	return err;
+}
+
+/*
+ * cmidid_config_modify: Changes single values of the configuration.
+ * The active configuration is copied, passed to `modify' and then
+ * published. Concurrent modifications are serialized, so no update is lost.
+ *
+ * @state: The configuration of the instance.
+ * @modify: Callback which changes the copy of the configuration.
+ * @arg: Passed to `modify'.
+ * @result: If not NULL, the published configuration is copied here.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+int cmidid_config_modify(struct cmidid_config_state *state,
+			 void (*modify) (struct cmidid_config * cfg,
+					 long arg), long arg,
+			 struct cmidid_config *result)
+{
+	struct cmidid_config new;
+	int err;
+
+	mutex_lock(&state->mutex);
+	new = rcu_dereference_protected(state->active,
+					lockdep_is_held(&state->mutex))->cfg;
+	modify(&new, arg);
+	err = publish_config(state, &new);
+	if (err == 0 && result != NULL)
+		*result = new;
+	mutex_unlock(&state->mutex);
+
+	return err;
+}
+
+/*
+ * cmidid_config_init: Publishes the initial configuration.
+ *
+ * @state: The configuration of the instance.
+ * @defaults: The configuration built from the module parameters.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+int cmidid_config_init(struct cmidid_config_state *state,
+		       const struct cmidid_config *defaults)
+{
+	int err;
+
+	mutex_init(&state->mutex);
+	RCU_INIT_POINTER(state->active, NULL);
+
+	if ((err = cmidid_config_set(state, defaults)) < 0)
+		err("%d. Invalid initial configuration.\n", err);
+
+	return err;
+}
+
+/*
+ * cmidid_config_exit: Frees the active configuration. All users of the
+ * configuration must be stopped before.
+ *
+ * @state: The configuration of the instance.
+ */
+void cmidid_config_exit(struct cmidid_config_state *state)
+{
+	struct cmidid_config_snapshot *old;
+
+	mutex_lock(&state->mutex);
+	old = rcu_dereference_protected(state->active,
+					lockdep_is_held(&state->mutex));
+	RCU_INIT_POINTER(state->active, NULL);
+	mutex_unlock(&state->mutex);
+
+	synchronize_rcu();
+	kfree(old);
+}
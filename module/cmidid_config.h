@@ -0,0 +1,41 @@
+#ifndef CMIDID_CONFIG_H
+#define CMIDID_CONFIG_H
+
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+
+#include "cmidid_ioctl.h"
+
+struct cmidid_config_snapshot;
+
+/*
+ * cmidid_config_state:
+ *
+ * The runtime configuration of one instance.
+ *
+ * @active: the published snapshot; readers need rcu_read_lock
+ * @mutex: serializes all writers; readers never take it
+ */
+struct cmidid_config_state {
+	struct cmidid_config_snapshot __rcu *active;
+	struct mutex mutex;
+};
+
+int cmidid_config_get(struct cmidid_config_state *state,
+		      struct cmidid_config *cfg);
+int cmidid_config_check(const struct cmidid_config *cfg);
+int cmidid_config_set(struct cmidid_config_state *state,
+		      const struct cmidid_config *cfg);
+int cmidid_config_modify(struct cmidid_config_state *state,
+			 void (*modify) (struct cmidid_config * cfg,
+					 long arg), long arg,
+			 struct cmidid_config *result);
+
+const struct cmidid_config *cmidid_config_deref(struct cmidid_config_state
+						*state);
+
+int cmidid_config_init(struct cmidid_config_state *state,
+		       const struct cmidid_config *defaults);
+void cmidid_config_exit(struct cmidid_config_state *state);
+
+#endif
@@ -0,0 +1,221 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+
+#include "cmidid_util.h"
+#include "cmidid_event.h"
+
+/*
+ * The number of records in the event ring. Rounded up to a power of two.
+ */
+static unsigned int event_ring_size = 4096;
+module_param(event_ring_size, uint, 0);
+MODULE_PARM_DESC(event_ring_size,
+		 "number of records in the mmap-able event ring of /dev/cmidid<N>");
+
+/*
+ * cmidid_event_file:
+ *
+ * Per open file state of /dev/cmidid<N>.
+ *
+ * @state: the event ring of the instance
+ * @poll_head: the ring head seen by the last poll() which reported new data
+ */
+struct cmidid_event_file {
+	struct cmidid_event_state *state;
+	u32 poll_head;
+};
+
+/*
+ * cmidid_event_push: Append a record to the event ring and wake up
+ * consumers. May be called from any context.
+ *
+ * @state: The event ring of the instance.
+ * @ev: The record to append. `seq' is set here.
+ */
+void cmidid_event_push(struct cmidid_event_state *state,
+		       struct cmidid_event *ev)
+{
+	struct cmidid_event *rec;
+	unsigned long flags;
+	u32 head;
+
+	if (state->area == NULL)
+		return;
+
+	spin_lock_irqsave(&state->lock, flags);
+
+	head = state->header->head;
+	rec = &state->records[head & state->mask];
+
+	/*
+	 * Invalidate the record first, so readers notice the overwrite.
+	 * No reader expects `head - 1' in this slot.
+	 */
+	ACCESS_ONCE(rec->seq) = head - 1;
+	smp_wmb();
+
+	ev->seq = head - 1;
+	*rec = *ev;
+	smp_wmb();
+	ACCESS_ONCE(rec->seq) = head;
+
+	smp_wmb();
+	ACCESS_ONCE(state->header->head) = head + 1;
+
+	spin_unlock_irqrestore(&state->lock, flags);
+
+	/*
+	 * Pairs with the barrier of poll_wait/prepare_to_wait: either the
+	 * reader sees the new head, or we see the reader on the wait queue.
+	 */
+	smp_mb();
+	if (waitqueue_active(&state->wait))
+		wake_up_interruptible(&state->wait);
+}
+
+/*
+ * cmidid_event_open: Allocates the per file state.
+ *
+ * @state: The event ring of the instance the file belongs to.
+ * @f: The opened file.
+ *
+ * Return: 0 on success; -ENOMEM otherwise.
+ */
+int cmidid_event_open(struct cmidid_event_state *state, struct file *f)
+{
+	struct cmidid_event_file *ef;
+
+	ef = kzalloc(sizeof(*ef), GFP_KERNEL);
+	if (ef == NULL)
+		return -ENOMEM;
+
+	ef->state = state;
+	ef->poll_head = ACCESS_ONCE(state->header->head);
+	f->private_data = ef;
+
+	return 0;
+}
+
+/*
+ * cmidid_event_release: Frees the per file state.
+ *
+ * Return: 0
+ */
+int cmidid_event_release(struct file *f)
+{
+	kfree(f->private_data);
+	return 0;
+}
+
+/*
+ * cmidid_event_mmap: Maps the event ring read-only into a process.
+ *
+ * @f: pointer to cmidid file; /dev/cmidid<N>
+ * @vma: the mapping; must start at CMIDID_MMAP_EVENT_RING and must not be
+ * larger than the ring.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+int cmidid_event_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct cmidid_event_state *state =
+	    ((struct cmidid_event_file *)f->private_data)->state;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff != CMIDID_MMAP_EVENT_RING >> PAGE_SHIFT)
+		return -EINVAL;
+	if (size > state->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, state->area, 0);
+}
+
+/*
+ * cmidid_event_poll: Reports the file as readable if new records were
+ * appended since the last time poll() reported it readable.
+ *
+ * Consumers are expected to drain the ring from the mapping after every
+ * wakeup. Records appended while draining cause one more (possibly empty)
+ * wakeup, so no record can be missed.
+ *
+ * Return: POLLIN | POLLRDNORM if there are new records; 0 otherwise.
+ */
+unsigned int cmidid_event_poll(struct file *f, poll_table *wait)
+{
+	struct cmidid_event_file *ef = f->private_data;
+	struct cmidid_event_state *state = ef->state;
+	u32 head;
+
+	poll_wait(f, &state->wait, wait);
+
+	head = ACCESS_ONCE(state->header->head);
+	if (head == ef->poll_head)
+		return 0;
+
+	ef->poll_head = head;
+	return POLLIN | POLLRDNORM;
+}
+
+/*
+ * cmidid_event_init: Allocates the event ring.
+ *
+ * @state: The event ring of the instance.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+int cmidid_event_init(struct cmidid_event_state *state)
+{
+	u32 num_records;
+
+	if (event_ring_size < 2 || event_ring_size > (1 << 20)) {
+		err("event_ring_size must be between 2 and %d\n", 1 << 20);
+		return -EINVAL;
+	}
+	num_records = roundup_pow_of_two(event_ring_size);
+
+	spin_lock_init(&state->lock);
+	init_waitqueue_head(&state->wait);
+
+	state->size = PAGE_SIZE +
+	    PAGE_ALIGN(num_records * sizeof(struct cmidid_event));
+	state->area = vmalloc_user(state->size);
+	if (state->area == NULL) {
+		err("Failed to allocate event ring of %zu bytes\n", state->size);
+		return -ENOMEM;
+	}
+
+	state->header = state->area;
+	state->records = state->area + PAGE_SIZE;
+	state->mask = num_records - 1;
+
+	state->header->version = CMIDID_EVENT_RING_VERSION;
+	state->header->record_size = sizeof(struct cmidid_event);
+	state->header->num_records = num_records;
+	state->header->data_offset = PAGE_SIZE;
+	state->header->head = 0;
+
+	dbg("event ring with %u records initialized\n", num_records);
+
+	return 0;
+}
+
+/*
+ * cmidid_event_exit: Frees the event ring. There are no mappings left at
+ * this point, since every mapping holds a reference to the module.
+ *
+ * @state: The event ring of the instance.
+ */
+void cmidid_event_exit(struct cmidid_event_state *state)
+{
+	vfree(state->area);
+	state->area = NULL;
+}
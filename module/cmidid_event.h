@@ -0,0 +1,48 @@
+#ifndef CMIDID_EVENT_H
+#define CMIDID_EVENT_H
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "cmidid_ioctl.h"
+
+/*
+ * cmidid_event_state:
+ *
+ * The event ring of one instance. The ring lives in a single vmalloc area
+ * which is mapped read-only into every consumer. The first page holds the
+ * header, the records follow on the next page.
+ *
+ * @lock: serializes writers; readers are lockless
+ * @wait: consumers sleeping in poll()
+ * @area: the vmalloc area
+ * @size: the size of the area in bytes
+ * @header: the header at the start of `area'
+ * @records: the records following the header
+ * @mask: num_records - 1
+ */
+struct cmidid_event_state {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	void *area;
+	size_t size;
+	struct cmidid_event_ring_header *header;
+	struct cmidid_event *records;
+	u32 mask;
+};
+
+void cmidid_event_push(struct cmidid_event_state *state,
+		       struct cmidid_event *ev);
+
+int cmidid_event_open(struct cmidid_event_state *state, struct file *f);
+int cmidid_event_release(struct file *f);
+int cmidid_event_mmap(struct file *f, struct vm_area_struct *vma);
+unsigned int cmidid_event_poll(struct file *f, poll_table *wait);
+
+int cmidid_event_init(struct cmidid_event_state *state);
+void cmidid_event_exit(struct cmidid_event_state *state);
+
+#endif
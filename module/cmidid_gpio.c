@@ -3,13 +3,33 @@
 #include <linux/stat.h>
 #include <linux/interrupt.h>
 #include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
+#include <linux/bitmap.h>
+#include <linux/firmware.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/cache.h>
 
 #include "cmidid_util.h"
+#include "cmidid_config.h"
 #include "cmidid_gpio.h"
+#include "cmidid_keyfsm.h"
+#include "cmidid_velocity.h"
 #include "cmidid_midi.h"
+#include "cmidid_event.h"
+#include "cmidid_keystate.h"
+#include "cmidid_stats.h"
+#include "cmidid_trace.h"
 
 /*
- * Mapping of GPIO-Pins to keys with corresponding pitch.
+ * Mapping of GPIO-Pins to keys with corresponding pitch. Only used for the
+ * first instance, if no keymap is given for it.
  * The format for passing the values is:
  * gpio_mapping=gpio1a,gpio1b,note1,gpio2a,gpio2b,note2,...
  */
@@ -70,251 +90,331 @@ MODULE_PARM_DESC(jitter_res_time,
 		 "timing offset before button hits are registered.");
 
 /*
- * START_BUTTON and END_BUTTON are used to index the GPIO buttons
- * in every key struct. START_BUTTON is the id for the button
- * which is hit first when the keyboard key starts to move.
- * The END_BUTTON is hit, when the key is completely pressed down.
- * Somwhat like this:
- *
- *   |  |
- *   v  v  v
- *  +--------------+
- *  | keyboard key | The key is fixed on this side :)
- *  +..............+=========
- *
- *   .---.    .---.
- *    end     start
- *
- * Example usage: state.keys[i].gpios[START_BUTTON].gpio ...
+ * The SCHED_FIFO priority of the IRQ threads which debounce the buttons
+ * and send the MIDI events. 0 runs them as normal (SCHED_OTHER) threads.
+ * The default equals the priority the kernel gives every IRQ thread.
  */
-#define START_BUTTON 0
-#define END_BUTTON 1
+static int irq_thread_priority = MAX_USER_RT_PRIO / 2;
+module_param(irq_thread_priority, int, 0);
+MODULE_PARM_DESC(irq_thread_priority,
+		 "SCHED_FIFO priority of the IRQ threads (0: SCHED_OTHER).");
 
 /*
- * Possible states for every key of our MIDI keyboard.
- * These values are used in `handle_button_event'.
- *
- * @KEY_INACTIVE: The key is not touched or pressed.
- * @KEY_TOUCHED: The first button of the key is activated. The key started to move.
- * @KEY_PRESSED: The second button is hit, so the key is completely pressed.
+ * The CPU the IRQ threads and, as far as the interrupt controller
+ * supports it, the GPIO interrupts are bound to. -1 means no binding.
+ */
+static int irq_thread_cpu = -1;
+module_param(irq_thread_cpu, int, 0);
+MODULE_PARM_DESC(irq_thread_cpu,
+		 "CPU to run the IRQ threads on (-1: any CPU).");
+
+/*
+ * Allows CMIDID_INJECT, which replays edges of simulated buttons. Meant for
+ * testing without hardware, see replay_test.c.
  */
-typedef enum {
-	KEY_INACTIVE,
-	KEY_TOUCHED,
-	KEY_PRESSED
-} KEY_STATE;
+static bool allow_inject;
+module_param(allow_inject, bool, 0);
+MODULE_PARM_DESC(allow_inject,
+		 "Allow simulated GPIO edges with the CMIDID_INJECT ioctl.");
+
+/* Number of scans of the key table averaged by the key scan measurement. */
+#define KEY_SCAN_ROUNDS 1000
 
 /*
- * VEL_CURVE: The types of interpolation curves used to calculate the
- * velocity for MIDI note_on events.
+ * struct cmidid_line:
+ *
+ * A requested GPIO port together with its interrupt. Lines are not part of
+ * a key table: they stay requested across remaps as long as the new table
+ * uses them, so a remap only touches the GPIOs which were added or removed.
+ *
+ * @list: Entry in the `lines' of the GPIO state.
+ * @state: The GPIO state of the instance the line belongs to.
+ * @gpio: The GPIO number.
+ * @irq: The IRQ number of the GPIO.
+ * @id: The index of the line in the `slots' array of a key table.
+ * @irq_time: Time of the interrupt which started the debouncing.
+ * @debouncing: Set while the IRQ thread waits for the button to settle.
+ * This is used to mitigate the jittering on every GPIO port.
+ * @sched_gen: The generation of the IRQ thread settings the IRQ thread
+ * has applied to itself.
+ * @sim_level: The level set with CMIDID_INJECT; -1 to read the GPIO.
  */
-typedef enum {
-	VEL_CURVE_LINEAR,
-	VEL_CURVE_CONCAVE,
-	VEL_CURVE_CONVEX,
-	VEL_CURVE_SATURATED,
-} VEL_CURVE;
+struct cmidid_line {
+	struct list_head list;
+	struct cmidid_gpio_state *state;
+	unsigned int gpio;
+	unsigned int irq;
+	int id;
+	ktime_t irq_time;
+	unsigned long debouncing;
+	int sched_gen;
+	int sim_level;
+};
 
 /*
  * struct key:
  *
- * This struct represents a single key for a MIDI keyboard.
- * Each of these keys is associated with two buttons/triggers which are
- * connected to two different GPIO ports of the machine.
- * One key struct is created for every two GPIO ports/numbers passed via
- * the `gpio_mapping' kernel parameter.
+ * This struct represents a single key for a MIDI keyboard. It only holds
+ * the hot data, i.e. everything which is read or written for a button
+ * event. The keys of a table are stored in an array of their own, separate
+ * from the setup data in struct key_setup: a key fits into 16 bytes, so
+ * scanning all 88 keys of a piano touches 22 cache lines of 64 bytes
+ * instead of 55.
  *
- * @KEY_STATE: The current state of the key, used for determinig when to trigger note on and off events
- * @gpios: The two GPIOs which are used to build every button in hardware.
- * @irqs: The IRQ numbers for the corresponding GPIOs.
  * @hit_time: Time (in ns) when the start button was hit/pressed.
- * @timer_started: This is used to mitigate the jittering on every GPIO port.
- * @hrtimers: Those are used to set a timeout for sending MIDI events.
+ * @state: The current KEY_STATE of the key, used for determinig when to
+ * trigger note on and off events.
  * @note: The corresponding MIDI note.
  * @last_velocity: The velocity (= strength) of the button hit.
+ * @channel: The MIDI channel of the key; -1 for the default channel.
+ * @curve: The velocity curve of the key; -1 for the curve of the config.
  */
 struct key {
-	KEY_STATE state;
-	struct gpio gpios[2];
-	unsigned int irqs[2];
 	ktime_t hit_time;
-	bool timer_started[2];
-	struct hrtimer hrtimers[2];
+	unsigned char state;
 	unsigned char note;
-	int last_velocity;
+	unsigned char last_velocity;
+	signed char channel;
+	signed char curve;
 };
 
 /*
- * cmidid_gpio_state:
+ * struct key_setup:
  *
- * The state of this GPIO component of our kernel module.
- * @keys: The array of available keys for our keyboard
- * @num_keys: the size of the keys array
- * @button_active_high: the polarity of the buttons of each key
- * @last_stroke_time: the time difference used for the last velocity computation; this is used for calibration
- * @stroke_time_min: The minimum time difference between the activation of the start and end button of a key used to compute the velocity
- * @stroke_time_max: The maximum time difference between the activation of the start and end button of a key used to compute the velocity
- * @vel_curve: which velocity curve to use
+ * The cold part of a key. Each of the keys is associated with two
+ * buttons/triggers which are connected to two different GPIO ports of the
+ * machine.
+ *
+ * @lock: Serializes the IRQ threads of both buttons in handle_button_event.
+ * @gpios: The two GPIOs which are used to build every button in hardware.
  */
-struct cmidid_gpio_state {
-	struct key *keys;
-	int num_keys;
+struct key_setup {
+	spinlock_t lock;
+	unsigned int gpios[2];
+};
+
+/*
+ * struct cmidid_slot: The key and button a line is connected to.
+ *
+ * @key: The index of the key; -1 if the line is not used by the key table.
+ * @button: START_BUTTON or END_BUTTON.
+ */
+struct cmidid_slot {
+	int key;
+	unsigned char button;
+};
+
+/*
+ * struct cmidid_keymap:
+ *
+ * A key table. It is built completely before it is published with RCU,
+ * so the IRQ threads always see either the old or the new table. Only the
+ * state of the keys changes after publishing.
+ *
+ * @slots: The key and button of every line, indexed by the line id.
+ * @num_slots: The size of the slots array.
+ * @button_active_high: The polarity of the buttons of each key.
+ * @debounce_time: The time (in ns) further interrupts of a button are
+ * ignored.
+ * @num_keys: The size of the keys and setup arrays.
+ * @keys: The hot data of the keys.
+ * @setup: The cold data of the keys.
+ */
+struct cmidid_keymap {
+	struct cmidid_slot *slots;
+	int num_slots;
 	bool button_active_high[2];
-	uint32_t last_stroke_time;
-	uint32_t stroke_time_min;
-	uint32_t stroke_time_max;
-	VEL_CURVE vel_curve;
+	unsigned int debounce_time;
+	int num_keys;
+	struct key *keys;
+	struct key_setup *setup;
 };
 
-struct cmidid_gpio_state state;
 
-static void handle_button_event(struct key *k, unsigned char button, bool active);
+static void handle_button_event(struct cmidid_gpio_state *state,
+				struct key *k, unsigned int index,
+				unsigned char button, bool active, ktime_t time,
+				const struct cmidid_config *cfg);
 static uint32_t stime64_to_utime32(s64 stime64);
-static unsigned char time_to_velocity(uint32_t t);
-static int get_key_from_irq(int irq, struct key **k_ret, unsigned char *button_ret);
-static struct key *get_key_from_timer(struct hrtimer *timer, unsigned char *index);
-static enum hrtimer_restart timer_irq(struct hrtimer *timer);
 static irqreturn_t irq_handler(int irq, void *dev_id);
-static bool is_valid(int gpio);
+static irqreturn_t handle_edge(struct cmidid_line *line, ktime_t time);
+static irqreturn_t irq_thread(int irq, void *dev_id);
+
+static void modify_min_stroke_time(struct cmidid_config *cfg, long t)
+{
+	cfg->stroke_time_min = t;
+}
+
+static void modify_max_stroke_time(struct cmidid_config *cfg, long t)
+{
+	cfg->stroke_time_max = t;
+}
+
+static void modify_vel_curve(struct cmidid_config *cfg, long curve)
+{
+	cfg->vel_curve = curve;
+}
 
 /*
  * cmidid_set_min_stroke_time: Use the last stroke time as new min_stroke_time.
  * Used for calibration.
  *
- * return: the new min_stroke_time value in 10^2 nanoseconds
+ * @state: The GPIO state of the instance.
+ *
+ * return: the new min_stroke_time value in 2^10 nanoseconds or a negative
+ * error code if it is not below the max_stroke_time.
  */
-uint32_t cmidid_set_min_stroke_time()
+long cmidid_set_min_stroke_time(struct cmidid_gpio_state *state)
 {
-	dbg("min stroke time set to %d\n", state.last_stroke_time);
-	return state.stroke_time_max = state.last_stroke_time;
+	uint32_t t = state->last_stroke_time;
+	int err;
+
+	dbg("min stroke time set to %d\n", t);
+	err = cmidid_config_modify(state->config, modify_min_stroke_time, t,
+				   NULL);
+
+	return err < 0 ? err : t;
 }
 
 /*
  * cmidid_set_max_stroke_time: Use the last stroke time as new max_stroke_time.
  * Used for calibration.
  *
- * return: the new max_stroke_time value in 10^2 nanoseconds
+ * @state: The GPIO state of the instance.
+ *
+ * return: the new max_stroke_time value in 2^10 nanoseconds or a negative
+ * error code if it is not above the min_stroke_time.
  */
-uint32_t cmidid_set_max_stroke_time()
+long cmidid_set_max_stroke_time(struct cmidid_gpio_state *state)
 {
-	dbg("max stroke time set to %d\n", state.last_stroke_time);
-	return state.stroke_time_max = state.last_stroke_time;
+	uint32_t t = state->last_stroke_time;
+	int err;
+
+	dbg("max stroke time set to %d\n", t);
+	err = cmidid_config_modify(state->config, modify_max_stroke_time, t,
+				   NULL);
+
+	return err < 0 ? err : t;
 }
 
 /*
  * cmidid_set_vel_curve_linear: Set the velocity curve to linear
  */
-void cmidid_set_vel_curve_linear()
+int cmidid_set_vel_curve_linear(struct cmidid_gpio_state *state)
 {
 	dbg("velocity curve set to linear\n");
-	state.vel_curve = VEL_CURVE_LINEAR;
+	return cmidid_config_modify(state->config, modify_vel_curve,
+				    VEL_CURVE_LINEAR, NULL);
 }
 
 /*
  * cmidid_set_vel_curve_concave: Set the velocity curve to concave
  */
-void cmidid_set_vel_curve_concave()
+int cmidid_set_vel_curve_concave(struct cmidid_gpio_state *state)
 {
 	dbg("velocity curve set to concave\n");
-	state.vel_curve = VEL_CURVE_CONCAVE;
+	return cmidid_config_modify(state->config, modify_vel_curve,
+				    VEL_CURVE_CONCAVE, NULL);
 }
 
 /*
  * cmidid_set_vel_curve_convex: Set the velocity curve to convex
  */
-void cmidid_set_vel_curve_convex()
+int cmidid_set_vel_curve_convex(struct cmidid_gpio_state *state)
 {
 	dbg("velocity curve set to convex\n");
-	state.vel_curve = VEL_CURVE_CONVEX;
+	return cmidid_config_modify(state->config, modify_vel_curve,
+				    VEL_CURVE_CONVEX, NULL);
 }
 
 /*
  * cmidid_set_vel_curve_saturated: Set the velocity curve to saturated
  */
-void cmidid_set_vel_curve_saturated()
+int cmidid_set_vel_curve_saturated(struct cmidid_gpio_state *state)
 {
 	dbg("velocity curve set to saturated\n");
-	state.vel_curve = VEL_CURVE_SATURATED;
+	return cmidid_config_modify(state->config, modify_vel_curve,
+				    VEL_CURVE_SATURATED, NULL);
 }
 
 /*
  * handle_button_event: Changes the state of the given key according to the
- * previous state and the state of the given button.
+ * previous state and the state of the given button, see key_transitions
+ * in cmidid_keyfsm.h.
  *
+ * @state: The GPIO state of the instance.
  * @k: The key which is associated with the current button event.
+ * @index: The index of the key in the key table.
  * @button: The id of the button. Can be START_BUTTON or END_BUTTON.
  * @active: true if the button was pressed, false if the button was released.
+ * @time: The time of the edge which started the debouncing. Stroke times
+ * are measured between these, so they do not include the debouncing and
+ * the wakeup of the IRQ thread.
+ * @cfg: The configuration snapshot used for this event.
  */
-static void handle_button_event(struct key *k, unsigned char button,
-				bool active)
+static void handle_button_event(struct cmidid_gpio_state *state,
+				struct key *k, unsigned int index,
+				unsigned char button, bool active, ktime_t time,
+				const struct cmidid_config *cfg)
 {
-	unsigned char velocity;
+	struct key_transition t = key_transition(k->state, button, active);
 	uint32_t timediff;
+	s64 delay = ktime_to_ns(ktime_sub(ktime_get(), time));
+	struct cmidid_event ev = {
+		.timestamp = ktime_to_ns(time),
+		.delay = min_t(s64, delay, U32_MAX),
+		.key = index,
+		.button = button,
+		.active = active,
+		.old_state = k->state,
+		.note = k->note,
+	};
+
+	if (t.actions & KEY_ACTION_NOTE_OFF)
+		cmidid_note_off(state->midi, cfg, k->channel, k->note);
+
+	if (t.actions & KEY_ACTION_HIT)
+		k->hit_time = time;
+
+	if (t.actions & KEY_ACTION_MEASURE) {
+		timediff =
+		    stime64_to_utime32(ktime_sub(time, k->hit_time).tv64);
+
+		state->last_stroke_time = timediff;
+
+		k->last_velocity = time_to_velocity(timediff, k->curve < 0 ?
+						    cfg->vel_curve : k->curve,
+						    cfg);
+		ev.stroke_time = timediff;
+	}
 
-	/* Switch the last state of the current key. */
-	switch (k->state) {
-	case KEY_INACTIVE:
-		/* The key was inactive (not pressed in any way) previously. */
-		if ((button == START_BUTTON) && active) {
-			/* First button was hit -> button not pressed completely. */
-			k->hit_time = ktime_get();
-			k->state = KEY_TOUCHED;
-		} else if ((button == START_BUTTON) && !active) {
-			/* First buttons was release -> key was released. */
-			cmidid_note_off(k->note);
-		}
-		break;
-	case KEY_TOUCHED:
-		/* Only the first button of the key was pressed previously. */
-		if ((button == START_BUTTON) && !active) {
-			/* The first button is released -> not pressed. */
-			cmidid_note_off(k->note);
-			k->state = KEY_INACTIVE;
-		} else if ((button == END_BUTTON) && active) {
-			/* The second button is hit -> pressed completely. */
-			timediff =
-			    stime64_to_utime32(ktime_sub
-					       (ktime_get(), k->hit_time).tv64);
-
-			state.last_stroke_time = timediff;
-
-			velocity = time_to_velocity(timediff);
-			cmidid_note_on(k->note, velocity);
-
-			k->last_velocity = velocity;
-			k->state = KEY_PRESSED;
-		}
-		break;
-	case KEY_PRESSED:
-		/* The key was fully pressed down previously. */
-		if ((button == START_BUTTON) && !active) {
-			/* The first button was released -> not pressed.
-			 * Note: This shouldn't happen (?) for a real key.
-			 */
-			cmidid_note_off(k->note);
-			k->state = KEY_INACTIVE;
-		} else if ((button == END_BUTTON) && active) {
-			/* The second button was hit again. */
-			cmidid_note_off(k->note);
-			cmidid_note_on(k->note, k->last_velocity);
-		}
-		break;
-	default:
-		cmidid_note_off(k->note);
-		k->state = KEY_INACTIVE;
+	if (t.actions & KEY_ACTION_NOTE_ON) {
+		cmidid_note_on(state->midi, cfg, k->channel, k->note,
+			       k->last_velocity);
+		ev.velocity = k->last_velocity;
 	}
 
+	k->state = t.next;
+
+	ev.new_state = k->state;
+	trace_cmidid_key_state(ev.key, button, active, ev.old_state,
+			       ev.new_state, ev.stroke_time, ev.timestamp);
+	if (ev.new_state != ev.old_state || ev.velocity != 0)
+		cmidid_keystate_update(state->keystate, ev.key, k->state,
+				       k->last_velocity);
+	cmidid_event_push(state->events, &ev);
+
 	dbg("key state: %d, button: %d, active: %d, note: %d\n", k->state,
 	    button, active, k->note);
 }
 
 /*
- * time_to_velocity: Returns a MIDI velocity value between 0 and 127
- * for a given key hit time (in ns).
+ * stime64_to_utime32: Converts a time difference to the unit of the stroke
+ * times.
  *
  * @stime64: signed 64bit integer representing a time value in nanoseconds.
  *
- * Return: the corresponding velocity.
+ * Return: the time in 2^10 nanoseconds.
  */
 static uint32_t stime64_to_utime32(s64 stime64)
 {
@@ -323,245 +423,760 @@ static uint32_t stime64_to_utime32(s64 stime64)
 }
 
 /*
- * time_to_velocity: Maps the measured time difference to a velocity.
- * The state.vel_curve determines which function is used the interpolate
- * between the minimum and maximum stroke time.
- *
- * @t: time value in 2^10 nanoseconds
- *
- * Return: The calculated velocity.
- */
-static unsigned char time_to_velocity(uint32_t t)
-{
-	uint32_t a, b, c, t_sat;
-	
-	if (t <= state.stroke_time_min) return 127;
-	if (t >= state.stroke_time_max) return 0;
-
-	switch (state.vel_curve) {
-	case VEL_CURVE_LINEAR:
-		return 127 * (state.stroke_time_max -
-			      t) / (state.stroke_time_max -
-				    state.stroke_time_min);
-	case VEL_CURVE_CONCAVE:
-		c = 255;
-		a = (-127 * c + c * c) * (state.stroke_time_max -
-					  state.stroke_time_min) / 127;
-		b = (c * state.stroke_time_max + 127 * state.stroke_time_min -
-		     c * state.stroke_time_min);
-		return a / (t - b) + c;
-	case VEL_CURVE_CONVEX:
-		if (t < state.stroke_time_min) {
-			return 127;
-		} else {
-			c = -40;
-			a = (-127 * c + c * c) * (state.stroke_time_max -
-						  state.stroke_time_min) / 127;
-			b = (c * state.stroke_time_max +
-			     127 * state.stroke_time_min -
-			     c * state.stroke_time_min);
-			return a / (t - b) + c;
-		}
-	case VEL_CURVE_SATURATED:
-		c = 140;
-		t_sat =
-		    state.stroke_time_min + (state.stroke_time_max -
-					     state.stroke_time_min) / 2;
-		a = (-127 * c + c * c) * (state.stroke_time_max - t_sat) / 127;
-		b = (c * state.stroke_time_max + 127 * t_sat - c * t_sat);
-		return a / (t - b) + c;
+ * apply_irq_thread_settings: Applies the current priority and CPU binding
+ * to the calling IRQ thread, if they changed since the last call.
+ *
+ * @line: The line of the IRQ thread.
+ */
+static void apply_irq_thread_settings(struct cmidid_line *line)
+{
+	struct cmidid_gpio_state *state = line->state;
+	struct cmidid_irq_thread settings;
+	struct sched_param param;
+	int gen;
+
+	spin_lock(&state->sched_lock);
+	gen = state->sched_gen;
+	settings = state->irq_thread;
+	spin_unlock(&state->sched_lock);
+
+	if (line->sched_gen == gen)
+		return;
+	line->sched_gen = gen;
+
+	param.sched_priority = settings.priority;
+	if (sched_setscheduler(current, settings.priority ? SCHED_FIFO :
+			       SCHED_NORMAL, &param) < 0)
+		warn("could not set priority %d of irq thread\n",
+		     settings.priority);
+
+	if (settings.cpu >= 0
+	    && set_cpus_allowed_ptr(current, cpumask_of(settings.cpu)) < 0)
+		warn("could not bind irq thread to cpu %d\n", settings.cpu);
+	else if (settings.cpu < 0)
+		set_cpus_allowed_ptr(current, cpu_online_mask);
+}
+
+/*
+ * line_value: Returns the level of a line; the simulated one if it was
+ * set with CMIDID_INJECT.
+ *
+ * @line: The line.
+ */
+static inline int line_value(struct cmidid_line *line)
+{
+	int level = ACCESS_ONCE(line->sim_level);
+
+	return level >= 0 ? level : gpio_get_value(line->gpio);
+}
+
+/*
+ * irq_thread: The threaded part of the interrupt handler. It waits until
+ * the debounce time of the key table has passed since the interrupt, reads the GPIO value
+ * to determine the state of the corresponding button and subsequently
+ * calls handle_button_event for the key the line belongs to in the
+ * current key table.
+ *
+ * The thread runs with the priority and on the CPU set with
+ * `irq_thread_priority' and `irq_thread_cpu' or CMIDID_SET_IRQ_THREAD.
+ *
+ * @irq: The number of the IRQ which is resposible for calling this function.
+ * @dev_id: The line the IRQ was requested for.
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t irq_thread(int irq, void *dev_id)
+{
+	struct cmidid_line *line = dev_id;
+	struct cmidid_gpio_state *state = line->state;
+	struct cmidid_keymap *map;
+	struct cmidid_slot *slot;
+	struct key *k;
+	int gpio_active;
+	unsigned int debounce_time = jitter_res_time;
+	ktime_t expires, now, edge_time;
+
+	apply_irq_thread_settings(line);
+
+	rcu_read_lock();
+	map = rcu_dereference(state->keymap);
+	if (map != NULL)
+		debounce_time = map->debounce_time;
+	rcu_read_unlock();
+
+	if (cmidid_stats_enabled())
+		cmidid_stats_record(CMIDID_STAGE_IRQ_TO_THREAD,
+				    ktime_to_ns(ktime_sub(ktime_get(),
+							  line->irq_time)));
+
+	/* Wait for the button to settle. */
+	expires = ktime_add_ns(line->irq_time, debounce_time);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+
+	if (cmidid_stats_enabled()) {
+		now = ktime_get();
+		cmidid_stats_record(CMIDID_STAGE_DEBOUNCE_LATE,
+				    ktime_to_ns(ktime_sub(now, expires)));
 	}
 
+	/*
+	 * Reset the flag before reading the value, so that an edge after
+	 * the read starts a new debounce cycle instead of getting lost.
+	 * Such an edge overwrites `irq_time', so take it before.
+	 */
+	edge_time = line->irq_time;
+	clear_bit(0, &line->debouncing);
+	smp_mb__after_clear_bit();
+
+	gpio_active = line_value(line);
+
+	dbg("Thread GPIO %d detected as %d\n", line->gpio, gpio_active);
+
+	rcu_read_lock();
+	map = rcu_dereference(state->keymap);
+
+	/* Lines are requested before the table which uses them is published. */
+	if (map == NULL || line->id >= map->num_slots
+	    || map->slots[line->id].key < 0)
+		goto unlock;
+
+	slot = &map->slots[line->id];
+	k = &map->keys[slot->key];
+
+	/*
+	 * Use one configuration snapshot for the whole event. The key lock
+	 * also disables preemption, so the statistics mark stays on this CPU.
+	 */
+	spin_lock(&map->setup[slot->key].lock);
+	cmidid_stats_mark();
+	handle_button_event(state, k, slot->key, slot->button,
+			    !(map->button_active_high[slot->button] ^
+			      gpio_active), edge_time,
+			    cmidid_config_deref(state->config));
+	cmidid_stats_clear_mark();
+	spin_unlock(&map->setup[slot->key].lock);
+
+ unlock:
+	rcu_read_unlock();
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * handle_edge: Starts the debouncing of a line unless it is already
+ * running. Must be called with interrupts disabled.
+ *
+ * @line: The line with the edge.
+ * @time: The time of the edge.
+ *
+ * Return: IRQ_WAKE_THREAD if the IRQ thread has to debounce the button;
+ * IRQ_HANDLED if the edge is ignored.
+ */
+static irqreturn_t handle_edge(struct cmidid_line *line, ktime_t time)
+{
+	bool ignored;
+
+	/* "Lock" the interrupt handler until the IRQ thread read the value. */
+	ignored = test_and_set_bit(0, &line->debouncing);
+	trace_cmidid_irq(line->irq, line->gpio, time.tv64, ignored);
+
+	if (ignored) {
+		cmidid_stats_count(CMIDID_COUNT_BOUNCE);
+		dbg("Ignore jitter for gpio %d.", line->gpio);
+		return IRQ_HANDLED;
+	}
+
+	line->irq_time = time;
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * irq_handler: The primary interrupt handler for every GPIO interrupt.
+ * This function is called when a rising/falling edge is registered on the
+ * GPIO port corresponding to the given IRQ number.
+ *
+ * Software resolution of jittering/bouncing is achieved by delaying the
+ * read on the GPIO port by a fixed amount of time in `irq_thread'. Other
+ * interrupts for this port are ignored during this period of time.
+ *
+ * @irq: The number of the IRQ which is resposible for calling this function.
+ * @dev_id: The line the IRQ was requested for.
+ *
+ * Return: IRQ_WAKE_THREAD if the IRQ thread has to debounce the button;
+ * IRQ_HANDLED if the interrupt is ignored.
+ */
+static irqreturn_t irq_handler(int irq, void *dev_id)
+{
+	struct cmidid_line *line = dev_id;
+	ktime_t time = ktime_get();
+
+#ifdef DEBUG
+	/* Only for debugging purposes: */
+	dbg("Interrupt handler called %d: gpio %d value %d. (%lld ns)\n",
+	    irq, line->gpio, line_value(line), time.tv64);
+#endif
+
+	return handle_edge(line, time);
+}
+
+/*
+ * irq_thread_mask: Returns the affinity mask for the IRQ threads.
+ *
+ * @settings: The settings of the IRQ threads.
+ *
+ * Return: The mask of the CPU or NULL if the threads are not bound.
+ */
+static const struct cpumask *irq_thread_mask(const struct cmidid_irq_thread
+					     *settings)
+{
+	return settings->cpu >= 0 ? cpumask_of(settings->cpu) : NULL;
+}
+
+/*
+ * cmidid_gpio_get_irq_thread: Returns the settings of the IRQ threads.
+ *
+ * @state: The GPIO state of the instance.
+ * @settings: The location to store the settings.
+ */
+void cmidid_gpio_get_irq_thread(struct cmidid_gpio_state *state,
+				struct cmidid_irq_thread *settings)
+{
+	spin_lock(&state->sched_lock);
+	*settings = state->irq_thread;
+	spin_unlock(&state->sched_lock);
+}
+
+/*
+ * cmidid_gpio_set_irq_thread: Changes the priority and CPU binding of the
+ * IRQ threads. Every thread applies the new settings to itself the next
+ * time it runs. The GPIO interrupts get an affinity hint for the CPU.
+ *
+ * @state: The GPIO state of the instance.
+ * @settings: The new settings.
+ *
+ * Return: 0 on success; -EINVAL if the settings are invalid.
+ */
+int cmidid_gpio_set_irq_thread(struct cmidid_gpio_state *state,
+			       const struct cmidid_irq_thread *settings)
+{
+	struct cmidid_line *line;
+
+	if (settings->priority < 0 || settings->priority >= MAX_USER_RT_PRIO)
+		return -EINVAL;
+	if (settings->cpu >= 0
+	    && (settings->cpu >= nr_cpu_ids || !cpu_online(settings->cpu)))
+		return -EINVAL;
+
+	mutex_lock(&state->remap_mutex);
+
+	spin_lock(&state->sched_lock);
+	state->irq_thread = *settings;
+	state->sched_gen++;
+	spin_unlock(&state->sched_lock);
+
+	list_for_each_entry(line, &state->lines, list)
+		irq_set_affinity_hint(line->irq, irq_thread_mask(settings));
+
+	mutex_unlock(&state->remap_mutex);
+
+	dbg("irq threads: priority %d, cpu %d\n", settings->priority,
+	    settings->cpu);
+
 	return 0;
 }
 
 /*
- * get_key_from_irq: Sets the key struct and the button index for a given irq.
+ * get_line: Returns the line of a GPIO, requesting the GPIO and its
+ * interrupt if no line exists yet. Must be called with `remap_mutex' held.
  *
- * @irq: The IRQ value which is used to find the enclosing key struct.
- * @key_ret: This pointer will be set to the struct containing irq.
- * @button_ret: The index of the button/irq will be written into this char.
+ * @state: The GPIO state of the instance.
+ * @gpio: The GPIO number.
  *
- * Return: 0 if a struct could be found, -1 otherwise.
+ * Return: The line or an ERR_PTR.
  */
-static int get_key_from_irq(int irq, struct key **k_ret, unsigned char *button_ret)
+static struct cmidid_line *get_line(struct cmidid_gpio_state *state, int gpio)
 {
-	struct key *k;
+	struct cmidid_line *line;
+	struct cmidid_irq_thread settings;
+	int err;
 
-	for (k = state.keys; k < state.keys + state.num_keys; k++) {
-		if (k->irqs[START_BUTTON] == irq) {
-			*k_ret = k;
-			*button_ret = START_BUTTON;
-			return 0;
-		}
+	if (!gpio_is_valid(gpio)) {
+		err("Invalid gpio: %d\n", gpio);
+		return ERR_PTR(-EINVAL);
+	}
 
-		if (k->irqs[END_BUTTON] == irq) {
-			*k_ret = k;
-			*button_ret = END_BUTTON;
-			return 0;
-		}
+	if (state->gpio_lines[gpio] != NULL)
+		return state->gpio_lines[gpio];
+
+	line = kzalloc(sizeof(*line), GFP_KERNEL);
+	if (line == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	line->state = state;
+	line->gpio = gpio;
+	line->sched_gen = -1;
+	line->sim_level = -1;
+
+	line->id = ida_simple_get(&state->line_ids, 0, 0, GFP_KERNEL);
+	if (line->id < 0) {
+		err = line->id;
+		goto free_line;
+	}
+
+	if ((err = gpio_request_one(gpio, GPIOF_IN, "cmidid")) < 0) {
+		err("Could not request gpio %d.\n", gpio);
+		goto free_id;
 	}
 
-	return -1;
+	if ((err = gpio_to_irq(gpio)) < 0) {
+		err("Could not request irq for gpio %d.\n", gpio);
+		goto free_gpio;
+	}
+	line->irq = err;
+
+	if ((err = request_threaded_irq(line->irq, irq_handler, irq_thread,
+					IRQF_TRIGGER_RISING |
+					IRQF_TRIGGER_FALLING, "cmidid",
+					line)) < 0) {
+		err("Could not request irq %d for gpio %d.\n", line->irq, gpio);
+		goto free_gpio;
+	}
+
+	cmidid_gpio_get_irq_thread(state, &settings);
+	irq_set_affinity_hint(line->irq, irq_thread_mask(&settings));
+
+	list_add_tail(&line->list, &state->lines);
+	state->gpio_lines[gpio] = line;
+	dbg("requested gpio %d with irq %d\n", gpio, line->irq);
+
+	return line;
+
+ free_gpio:
+	gpio_free(gpio);
+ free_id:
+	ida_simple_remove(&state->line_ids, line->id);
+ free_line:
+	kfree(line);
+
+	return ERR_PTR(err);
 }
 
 /*
- * get_key_from_timer: Helper function to get the enclosing key struct
- * and the button index for a given hrtimer pointer.
+ * put_unused_lines: Frees all lines which are not used by the given key
+ * table. free_irq waits for running IRQ threads of the line. Must be called
+ * with `remap_mutex' held.
  *
- * @timer: Pointer which is used to find the enclosing key struct.
- * @index: The index of the corresponding button is written to this location.
+ * @state: The GPIO state of the instance.
+ * @map: The key table in effect; may be NULL.
+ */
+static void put_unused_lines(struct cmidid_gpio_state *state,
+			     struct cmidid_keymap *map)
+{
+	struct cmidid_line *line, *tmp;
+
+	list_for_each_entry_safe(line, tmp, &state->lines, list) {
+		if (map != NULL && line->id < map->num_slots
+		    && map->slots[line->id].key >= 0)
+			continue;
+
+		dbg("freeing gpio %d\n", line->gpio);
+		list_del(&line->list);
+		state->gpio_lines[line->gpio] = NULL;
+		irq_set_affinity_hint(line->irq, NULL);
+		free_irq(line->irq, line);
+		gpio_free(line->gpio);
+		ida_simple_remove(&state->line_ids, line->id);
+		kfree(line);
+	}
+}
+
+/*
+ * free_keymap: Frees a key table and its arrays.
  *
- * Return: The pointer to the struct which contains `timer' or NULL if no
- * such struct could be found.
+ * @map: The key table; may be NULL.
  */
-static struct key *get_key_from_timer(struct hrtimer *timer,
-				      unsigned char *index)
+static void free_keymap(struct cmidid_keymap *map)
 {
-	struct key *k;
+	if (map == NULL)
+		return;
 
-	for (k = state.keys; k < state.keys + state.num_keys; k++) {
-		if (&k->hrtimers[START_BUTTON] == timer) {
-			*index = START_BUTTON;
-			return k;
-		}
-		if (&k->hrtimers[END_BUTTON] == timer) {
-			*index = END_BUTTON;
-			return k;
-		}
+	kfree(map->slots);
+	kfree(map->setup);
+	kfree(map->keys);
+	kfree(map);
+}
+
+/*
+ * release_keymap: Sends a note_off for every key of an unpublished key
+ * table which still sounds and frees the table. There must be no readers
+ * of the table left, i.e. a grace period must have passed.
+ *
+ * @state: The GPIO state of the instance.
+ * @map: The key table; may be NULL.
+ */
+static void release_keymap(struct cmidid_gpio_state *state,
+			   struct cmidid_keymap *map)
+{
+	int i;
+
+	if (map == NULL)
+		return;
+
+	rcu_read_lock();
+	for (i = 0; i < map->num_keys; i++) {
+		if (map->keys[i].state == KEY_PRESSED)
+			cmidid_note_off(state->midi,
+					cmidid_config_deref(state->config),
+					map->keys[i].channel,
+					map->keys[i].note);
 	}
+	rcu_read_unlock();
 
-	return NULL;
+	free_keymap(map);
 }
 
 /*
- * timer_irq: The interrupt handler routine reads the GPIO values to
- * determine the state of the corresponding button and subsequently callsx 
- * handle_button_event. This function is delayed for a fixed time after
- * the interrupt on the GPIO port is registered.
+ * build_keymap: Builds a new key table and requests the lines it needs.
+ * Must be called with `remap_mutex' held.
  *
- * @timer: hrtimer that uses this function as a callback
+ * @state: The GPIO state of the instance.
+ * @mapping: The GPIOs, note, channel and curve of every key.
+ * @num_keys: The number of keys.
+ * @flags: CMIDID_REMAP_START_ACTIVE_HIGH and CMIDID_REMAP_END_ACTIVE_HIGH.
+ * @debounce_time: The debounce time (in ns); 0 for `jitter_res_time'.
  *
- * Return: HRTIMER_NORESTART; the timer has to be reset manually.
+ * Return: The new table or an ERR_PTR. Lines requested for a table which
+ * could not be built have to be freed with put_unused_lines.
  */
-static enum hrtimer_restart timer_irq(struct hrtimer *timer)
+static struct cmidid_keymap *build_keymap(struct cmidid_gpio_state *state,
+					  const struct cmidid_key_mapping
+					  *mapping, unsigned int num_keys,
+					  unsigned int flags,
+					  unsigned int debounce_time)
 {
+	struct cmidid_keymap *map;
+	struct cmidid_line *line;
+	unsigned long *used;
 	struct key *k;
-	int gpio_active;	// gpio_value_start, gpio_value_end;
-	unsigned char button;
+	struct key_setup *setup;
+	int i, b, gpio, err;
+
+	/* Four keys per cache line, see struct key. */
+	BUILD_BUG_ON(sizeof(struct key) != 16);
+
+	used = kcalloc(BITS_TO_LONGS(ARCH_NR_GPIOS), sizeof(long), GFP_KERNEL);
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (used == NULL || map == NULL) {
+		err = -ENOMEM;
+		goto free_map;
+	}
+
+	map->keys = kcalloc(num_keys, sizeof(struct key), GFP_KERNEL);
+	map->setup = kcalloc(num_keys, sizeof(struct key_setup), GFP_KERNEL);
+	if (map->keys == NULL || map->setup == NULL) {
+		err = -ENOMEM;
+		goto free_map;
+	}
+
+	map->num_keys = num_keys;
+	map->button_active_high[START_BUTTON] =
+	    flags & CMIDID_REMAP_START_ACTIVE_HIGH;
+	map->button_active_high[END_BUTTON] =
+	    flags & CMIDID_REMAP_END_ACTIVE_HIGH;
+	map->debounce_time = debounce_time ? debounce_time : jitter_res_time;
+
+	for (i = 0; i < num_keys; i++) {
+		k = &map->keys[i];
+		setup = &map->setup[i];
+
+		if (mapping[i].note > 127
+		    || (mapping[i].channel > 15
+			&& mapping[i].channel != CMIDID_KEY_DEFAULT)
+		    || (mapping[i].curve > VEL_CURVE_SATURATED
+			&& mapping[i].curve != CMIDID_KEY_DEFAULT)) {
+			err("Invalid note, channel or curve for key %d\n", i);
+			err = -EINVAL;
+			goto free_map;
+		}
 
-	/* The following line removes an annoying warning :) TODO */
-	k = NULL;
-	k = get_key_from_timer(timer, &button);
+		k->state = KEY_INACTIVE;
+		k->note = mapping[i].note;
+		k->channel = mapping[i].channel == CMIDID_KEY_DEFAULT ?
+		    -1 : mapping[i].channel;
+		k->curve = mapping[i].curve == CMIDID_KEY_DEFAULT ?
+		    -1 : mapping[i].curve;
+		spin_lock_init(&setup->lock);
+
+		for (b = START_BUTTON; b <= END_BUTTON; b++) {
+			gpio = mapping[i].gpios[b];
+			if (gpio_is_valid(gpio) && test_and_set_bit(gpio, used)) {
+				err("gpio: %d is invalid. It was already used...\n", gpio);
+				err = -EINVAL;
+				goto free_map;
+			}
+
+			line = get_line(state, gpio);
+			if (IS_ERR(line)) {
+				err = PTR_ERR(line);
+				goto free_map;
+			}
+			setup->gpios[b] = line->gpio;
+		}
+
+		dbg("Setting key: gpio_start = %d, gpio_end = %d, note = %d\n",
+		    setup->gpios[START_BUTTON], setup->gpios[END_BUTTON],
+		    k->note);
+	}
+
+	list_for_each_entry(line, &state->lines, list)
+		map->num_slots = max(map->num_slots, line->id + 1);
+
+	map->slots = kmalloc(map->num_slots * sizeof(struct cmidid_slot),
+			     GFP_KERNEL);
+	if (map->slots == NULL) {
+		err = -ENOMEM;
+		goto free_map;
+	}
+
+	for (i = 0; i < map->num_slots; i++)
+		map->slots[i].key = -1;
 
-	if (k == NULL) {
-		err("htimer not found \n");
-		return HRTIMER_NORESTART;
+	for (i = 0; i < num_keys; i++) {
+		for (b = START_BUTTON; b <= END_BUTTON; b++) {
+			line = state->gpio_lines[map->setup[i].gpios[b]];
+			map->slots[line->id].key = i;
+			map->slots[line->id].button = b;
+		}
 	}
 
-	gpio_active = gpio_get_value(k->gpios[button].gpio);
+	kfree(used);
 
-	/* Reset the flag, so that new interrupts will be registered. */
-	k->timer_started[button] = false;
+	return map;
 
-	dbg("Timer Button GPIO %d detected as %hhd index: %d\n",
-	    k->gpios[button].gpio, gpio_active, button);
-	handle_button_event(k, button,
-			    !(state.button_active_high[button] ^ gpio_active));
+ free_map:
+	free_keymap(map);
+	kfree(used);
 
-	return HRTIMER_NORESTART;
+	return ERR_PTR(err);
 }
 
 /*
- * irq_handler: The interrupt handler for every GPIO interrupt.
- * This function is called when a rising/falling edge is registered on the
- * GPIO port corresponding to the given IRQ number.
+ * cmidid_gpio_remap: Replaces the key table while the module is running.
  *
- * Software resolution of jittering/bouncing is achieved by delaying the
- * read on the GPIO port by a fixed amount of time. Other interrupts for
- * this port are ignored during this period of time.
+ * The new table is built completely and the GPIOs and interrupts which are
+ * not used by the old table yet are requested before the table is
+ * published. After a grace period, no IRQ thread uses the old table any
+ * more: keys which still sound get a note_off and the lines which are not
+ * part of the new table are freed. If the new table cannot be built, the
+ * old one stays in effect.
  *
- * @irq: The number of the IRQ which is resposible for calling this function.
- * @dev_id: I have no idea :) Look at linux/interrupt.h.
+ * @state: The GPIO state of the instance.
+ * @mapping: The GPIOs, note, channel and curve of every key.
+ * @num_keys: The number of keys.
+ * @flags: CMIDID_REMAP_START_ACTIVE_HIGH and CMIDID_REMAP_END_ACTIVE_HIGH.
+ * @debounce_time: The debounce time (in ns); 0 for `jitter_res_time'.
  *
- * Return: IRQ_HANDLED
+ * Return: 0 on success; a negative error code otherwise.
  */
-static irqreturn_t irq_handler(int irq, void *dev_id)
+int cmidid_gpio_remap(struct cmidid_gpio_state *state,
+		      const struct cmidid_key_mapping *mapping,
+		      unsigned int num_keys, unsigned int flags,
+		      unsigned int debounce_time)
 {
-	struct key *k;
-	unsigned char index;
-	ktime_t diff;
-	int gpio_value_start, gpio_value_end, res;
-
-	ktime_t time = ktime_get();
-	index = 0;
-	k = NULL;
-	get_key_from_irq(irq, &k, &index);
+	struct cmidid_keymap *map, *old;
+	int err = 0;
 
-	/* Only for debugging purposes: */
-	gpio_value_start = gpio_get_value(k->gpios[START_BUTTON].gpio);
-	gpio_value_end = gpio_get_value(k->gpios[END_BUTTON].gpio);
+	/* Every key needs two GPIOs of its own. */
+	if (num_keys == 0 || num_keys > CMIDID_MAX_KEYS)
+		return -EINVAL;
 
-	dbg("Interrupt handler called %d: gpio value [%d, %d]. (%lld ns)\n",
-	    irq, gpio_value_start, gpio_value_end, time.tv64);
+	mutex_lock(&state->remap_mutex);
 
-	diff = ktime_set(0, jitter_res_time);
+	old = rcu_dereference_protected(state->keymap,
+					lockdep_is_held(&state->remap_mutex));
 
-	if (k != NULL && !k->timer_started[index]) {
-		/* Call the timer_irq delayed and "lock" the interrupt handler. */
-		res =
-		    hrtimer_start(&k->hrtimers[index], diff, HRTIMER_MODE_REL);
-		dbg("hrtimer_start res: :%d index: %d\n", res, index);
-		k->timer_started[index] = true;
-	} else {
-		dbg("Ignore jitter for k: %p button %d timer started: %d.", k,
-		    index, k->timer_started[index]);
+	map = build_keymap(state, mapping, num_keys, flags, debounce_time);
+	if (IS_ERR(map)) {
+		err = PTR_ERR(map);
+		put_unused_lines(state, old);
+		goto unlock;
 	}
-	return IRQ_HANDLED;
+
+	rcu_assign_pointer(state->keymap, map);
+	synchronize_rcu();
+
+	cmidid_keystate_set_num_keys(state->keystate, num_keys);
+	release_keymap(state, old);
+	put_unused_lines(state, map);
+
+	info("key table with %u keys in effect\n", num_keys);
+
+ unlock:
+	mutex_unlock(&state->remap_mutex);
+
+	return err;
 }
 
 /*
- * is_valid: Checks if a given GPIO number is already used for a key struct
- * or if the GPIO number is greater than the number of GPIOs available for
- * the current machine.
+ * cmidid_gpio_load_keymap: Loads a binary keymap with request_firmware and
+ * makes it the key table. The stroke times and velocity curve of the
+ * keymap header are checked before and applied to the configuration
+ * afterwards.
  *
- * @gpio: The GPIO number to be checked.
+ * @state: The GPIO state of the instance.
+ * @name: The name of the keymap file.
  *
- * Return: true is the number is a valid GPIO; false otherwise
+ * Return: 0 on success; a negative error code otherwise.
  */
-static bool is_valid(int gpio)
+int cmidid_gpio_load_keymap(struct cmidid_gpio_state *state, const char *name)
 {
-	int i;
-	for (i = 0; i < state.num_keys; i++) {
-		if (gpio == state.keys[i].gpios[START_BUTTON].gpio) {
-			dbg("gpio: %d is invalid. It was already used...\n",
-			    gpio);
-			return false;
-		}
-		if (gpio == state.keys[i].gpios[END_BUTTON].gpio) {
-			dbg("gpio: %d is invalid. It was already used...\n",
-			    gpio);
-			return false;
-		}
+	const struct firmware *fw;
+	const struct cmidid_keymap_header *hdr;
+	const struct cmidid_keymap_record *rec;
+	struct cmidid_key_mapping *mapping;
+	struct cmidid_config cfg;
+	unsigned int num_keys;
+	int i, err;
+
+	if ((err = request_firmware(&fw, name, state->device)) < 0) {
+		err("Could not load keymap %s: %d\n", name, err);
+		return err;
+	}
+
+	hdr = (const struct cmidid_keymap_header *)fw->data;
+	if (fw->size < sizeof(*hdr)
+	    || le32_to_cpu(hdr->magic) != CMIDID_KEYMAP_MAGIC
+	    || le32_to_cpu(hdr->version) != CMIDID_KEYMAP_VERSION) {
+		err("Keymap %s has an invalid header\n", name);
+		err = -EINVAL;
+		goto release;
 	}
 
-	return gpio_is_valid(gpio);
+	num_keys = le32_to_cpu(hdr->num_keys);
+	if (num_keys == 0 || num_keys > CMIDID_MAX_KEYS
+	    || fw->size < sizeof(*hdr) + num_keys * sizeof(*rec)) {
+		err("Keymap %s is truncated or has %u keys\n", name, num_keys);
+		err = -EINVAL;
+		goto release;
+	}
+
+	/* Check the configuration first, the remap cannot be undone. */
+	cmidid_config_get(state->config, &cfg);
+	if (hdr->stroke_time_min)
+		cfg.stroke_time_min = le32_to_cpu(hdr->stroke_time_min);
+	if (hdr->stroke_time_max)
+		cfg.stroke_time_max = le32_to_cpu(hdr->stroke_time_max);
+	if (le32_to_cpu(hdr->vel_curve) != CMIDID_KEY_DEFAULT)
+		cfg.vel_curve = le32_to_cpu(hdr->vel_curve);
+	if ((err = cmidid_config_check(&cfg)) < 0) {
+		err("Keymap %s has invalid stroke times or curve\n", name);
+		goto release;
+	}
+
+	mapping = kcalloc(num_keys, sizeof(*mapping), GFP_KERNEL);
+	if (mapping == NULL) {
+		err = -ENOMEM;
+		goto release;
+	}
+
+	rec = (const struct cmidid_keymap_record *)(hdr + 1);
+	for (i = 0; i < num_keys; i++) {
+		mapping[i].gpios[START_BUTTON] =
+		    le16_to_cpu(rec[i].gpios[START_BUTTON]);
+		mapping[i].gpios[END_BUTTON] =
+		    le16_to_cpu(rec[i].gpios[END_BUTTON]);
+		mapping[i].note = rec[i].note;
+		mapping[i].channel = rec[i].channel;
+		mapping[i].curve = rec[i].curve;
+	}
+
+	err = cmidid_gpio_remap(state, mapping, num_keys,
+				le32_to_cpu(hdr->flags),
+				le32_to_cpu(hdr->debounce_time));
+	kfree(mapping);
+	if (err < 0)
+		goto release;
+
+	/* The new key table is live, so this is no longer an error. */
+	if (cmidid_config_set(state->config, &cfg) < 0)
+		warn("Could not set the configuration of keymap %s\n", name);
+
+	dbg("keymap %s loaded\n", name);
+
+ release:
+	release_firmware(fw);
+
+	return err;
 }
 
 /*
- * gpio_init: Initialization routine for the GPIO component of the CMIDID
- * kernel driver. This will be called by cmidid_init.
+ * cmidid_gpio_inject: Simulates an edge of a GPIO of the key table. The
+ * edge is debounced and handled like an interrupt of the GPIO; afterwards
+ * the IRQ thread reads the simulated level instead of the GPIO.
  *
- * Return: A Linux error code.
+ * @state: The GPIO state of the instance.
+ * @inject: The GPIO and its new level; the time of the edge is returned in
+ * `timestamp'.
+ *
+ * Return: 0 on success; a negative error code otherwise.
  */
-int cmidid_gpio_init(void)
+int cmidid_gpio_inject(struct cmidid_gpio_state *state,
+		       struct cmidid_inject *inject)
 {
-	int i;
-	struct key *k;
-	unsigned int irq;
+	struct cmidid_line *line;
+	unsigned long flags;
+	ktime_t time;
 	int err = 0;
 
-	dbg("GPIO component initializing...\n");
+	if (!allow_inject)
+		return -EPERM;
+
+	if (!gpio_is_valid(inject->gpio) || inject->level < -1
+	    || inject->level > 1)
+		return -EINVAL;
+
+	/* The mutex keeps the line from being freed by a remap. */
+	mutex_lock(&state->remap_mutex);
+
+	line = state->gpio_lines[inject->gpio];
+	if (line == NULL) {
+		err = -ENOENT;
+		goto unlock;
+	}
+
+	ACCESS_ONCE(line->sim_level) = inject->level;
+	if (inject->level < 0)
+		goto unlock;
+
+	local_irq_save(flags);
+	time = ktime_get();
+	if (handle_edge(line, time) == IRQ_WAKE_THREAD)
+		irq_wake_thread(line->irq, line);
+	local_irq_restore(flags);
+
+	inject->timestamp = ktime_to_ns(time);
+
+ unlock:
+	mutex_unlock(&state->remap_mutex);
+
+	return err;
+}
+
+/*
+ * load_gpio_mapping: Makes the key table given with the `gpio_mapping',
+ * `start_button_active_high' and `end_button_active_high' parameters the
+ * key table.
+ *
+ * @state: The GPIO state of the instance.
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+static int load_gpio_mapping(struct cmidid_gpio_state *state)
+{
+	struct cmidid_key_mapping *mapping;
+	unsigned int num_keys, flags = 0;
+	int i, b, err;
 
 	/* Drop if the array length is invalid. */
 	if (gpio_mapping_size <= 0) {
@@ -575,151 +1190,220 @@ int cmidid_gpio_init(void)
 		return -EINVAL;
 	}
 
-	/* Allocate one button struct for every pair of gpios with pitch. */
-	state.num_keys = gpio_mapping_size / 3;
-	state.keys = kzalloc(state.num_keys * sizeof(struct key), GFP_KERNEL);
-
-	if (state.keys == NULL) {
+	num_keys = gpio_mapping_size / 3;
+	mapping = kcalloc(num_keys, sizeof(*mapping), GFP_KERNEL);
+	if (mapping == NULL) {
 		err("Failed to allocate memory\n");
 		return -ENOMEM;
 	}
 
-	state.last_stroke_time = 100000;
-	state.stroke_time_min = stroke_time_min;
-	state.stroke_time_max = stroke_time_max;
+	for (i = 0; i < num_keys; i++) {
+		if (gpio_mapping[3 * i + 2] < 0 || gpio_mapping[3 * i + 2] > 127) {
+			err("Invalid note: %d\n", gpio_mapping[3 * i + 2]);
+			kfree(mapping);
+			return -EINVAL;
+		}
 
-	state.vel_curve = VEL_CURVE_LINEAR;
+		for (b = START_BUTTON; b <= END_BUTTON; b++)
+			mapping[i].gpios[b] = gpio_mapping[3 * i + b];
+		mapping[i].note = gpio_mapping[3 * i + 2];
+		mapping[i].channel = CMIDID_KEY_DEFAULT;
+		mapping[i].curve = CMIDID_KEY_DEFAULT;
+	}
 
-	state.button_active_high[START_BUTTON] = start_button_active_high;
-	state.button_active_high[END_BUTTON] = end_button_active_high;
+	if (start_button_active_high)
+		flags |= CMIDID_REMAP_START_ACTIVE_HIGH;
+	if (end_button_active_high)
+		flags |= CMIDID_REMAP_END_ACTIVE_HIGH;
 
-	/* Initialize the state and key structs. */
-	for (i = 0; i < state.num_keys; i++) {
-		k = &state.keys[i];
+	err = cmidid_gpio_remap(state, mapping, num_keys, flags, 0);
+	kfree(mapping);
 
-		k->state = KEY_INACTIVE;
+	return err;
+}
 
-		k->last_velocity = 0;
+/*
+ * scan_keys: Visits the state of every key of a table, like a polling or
+ * matrix scan would on every tick. Must be called under rcu_read_lock.
+ *
+ * @map: The key table.
+ *
+ * Return: The number of keys which are touched or pressed.
+ */
+static int scan_keys(const struct cmidid_keymap *map)
+{
+	int i, active = 0;
 
-		if (!is_valid(gpio_mapping[3 * i + START_BUTTON])) {
-			err("Invalid gpio: %d\n",
-			    gpio_mapping[3 * i + START_BUTTON]);
-			err = -EINVAL;
-			goto free_buttons;
-		}
-		k->gpios[START_BUTTON].gpio =
-		    gpio_mapping[3 * i + START_BUTTON];
-		k->gpios[START_BUTTON].flags = GPIOF_IN;
-		k->gpios[START_BUTTON].label = "NO_LABEL";
-
-		if (!is_valid(gpio_mapping[3 * i + END_BUTTON])) {
-			err("Invalid gpio: %d\n",
-			    gpio_mapping[3 * i + END_BUTTON]);
-			err = -EINVAL;
-			goto free_buttons;
-		}
-		k->gpios[END_BUTTON].gpio = gpio_mapping[3 * i + END_BUTTON];
-		k->gpios[END_BUTTON].flags = GPIOF_IN;
-		k->gpios[END_BUTTON].label = "NO_LABEL";
+	for (i = 0; i < map->num_keys; i++)
+		if (ACCESS_ONCE(map->keys[i].state) != KEY_INACTIVE)
+			active++;
 
-		k->note = gpio_mapping[3 * i + 2];
+	return active;
+}
 
-		dbg("Setting key: gpio_start = %d, gpio_end = %d, note = %d\n",
-		    k->gpios[START_BUTTON].gpio, k->gpios[END_BUTTON].gpio,
-		    k->note);
+/*
+ * key_scan_show: Measures the time of scan_keys over the current key table
+ * and prints it together with the memory touched by a scan.
+ */
+static int key_scan_show(struct seq_file *m, void *v)
+{
+	struct cmidid_gpio_state *state = m->private;
+	struct cmidid_keymap *map;
+	ktime_t start = ktime_set(0, 0), end = ktime_set(0, 0);
+	int i, num_keys = 0, active = 0;
+
+	rcu_read_lock();
+	map = rcu_dereference(state->keymap);
+	if (map != NULL) {
+		num_keys = map->num_keys;
+
+		preempt_disable();
+		start = ktime_get();
+		for (i = 0; i < KEY_SCAN_ROUNDS; i++)
+			active = scan_keys(map);
+		end = ktime_get();
+		preempt_enable();
+	}
+	rcu_read_unlock();
 
-		if ((err = gpio_request_array(k->gpios, 2)) < 0) {
-			err("Could not request gpio %d or %d.",
-			    k->gpios[START_BUTTON].gpio,
-			    k->gpios[END_BUTTON].gpio);
-			goto free_buttons;
-		}
+	if (map == NULL) {
+		seq_puts(m, "no key table\n");
+		return 0;
+	}
 
-		irq = gpio_to_irq(k->gpios[START_BUTTON].gpio);
-		if (irq < 0) {
-			err("Could not request irq for gpio %d.\n",
-			    k->gpios[START_BUTTON].gpio);
-			err = irq;
-			goto free_buttons;
-		}
-		k->irqs[START_BUTTON] = irq;
-
-		/* Make sure that the timer init is called before 
-		 * requesting the irqs. That's because request_irq calls
-		 * the `irq_handler' function immediately (which uses the
-		 * hrtimer).
-		 */
-		hrtimer_init(&state.keys[i].hrtimers[START_BUTTON],
-			     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-		hrtimer_init(&state.keys[i].hrtimers[END_BUTTON],
-			     CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-		k->timer_started[START_BUTTON] = false;
-		k->timer_started[END_BUTTON] = false;
-
-		state.keys[i].hrtimers[START_BUTTON].function = &timer_irq;
-		state.keys[i].hrtimers[END_BUTTON].function = &timer_irq;
-
-		dbg("hrtimer initialized\n");
-		irq = gpio_to_irq(k->gpios[END_BUTTON].gpio);
-		if (irq < 0) {
-			err("Could not request irq for gpio %d.\n",
-			    k->gpios[END_BUTTON].gpio);
-			err = irq;
-			goto free_buttons;
-		}
-		k->irqs[END_BUTTON] = irq;
+	seq_printf(m, "keys: %d\n", num_keys);
+	seq_printf(m, "active keys: %d\n", active);
+	seq_printf(m, "key size: %zu bytes, setup size: %zu bytes\n",
+		   sizeof(struct key), sizeof(struct key_setup));
+	seq_printf(m, "cache lines per scan: %zu (%d bytes per line)\n",
+		   DIV_ROUND_UP(num_keys * sizeof(struct key), L1_CACHE_BYTES),
+		   L1_CACHE_BYTES);
+	seq_printf(m, "scan time: %lld ns (average of %d scans)\n",
+		   div_s64(ktime_to_ns(ktime_sub(end, start)), KEY_SCAN_ROUNDS),
+		   KEY_SCAN_ROUNDS);
 
-		if ((err =
-		     request_irq(k->irqs[START_BUTTON], irq_handler,
-				 IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
-				 "irq_start", NULL)) < 0) {
-			err("Could not request irq for key.\n");
-			err = -EINVAL;
-			goto free_buttons;
-		}
+	return 0;
+}
 
-		if ((err =
-		     request_irq(k->irqs[END_BUTTON], irq_handler,
-				 IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
-				 "irq_start", NULL)) < 0) {
-			err("Could not request irq for key.\n");
-			err = -EINVAL;
-			goto free_buttons;
-		}
+static int key_scan_open(struct inode *inode, struct file *f)
+{
+	return single_open(f, key_scan_show, inode->i_private);
+}
+
+static const struct file_operations key_scan_fops = {
+	.owner = THIS_MODULE,
+	.open = key_scan_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * gpio_init: Initialization routine for the GPIO component of an instance
+ * of the CMIDID kernel driver. This will be called by cmidid_init after the
+ * other components of the instance were initialized and linked into
+ * `state'.
+ *
+ * @state: The GPIO state of the instance.
+ * @keymap: The name of the binary keymap of the instance; NULL to use the
+ * `gpio_mapping' parameter, which is only possible for the first instance.
+ *
+ * Return: A Linux error code.
+ */
+int cmidid_gpio_init(struct cmidid_gpio_state *state, const char *keymap)
+{
+	int err = 0;
+	char name[16];
+	struct cmidid_config cfg = {
+		.version = CMIDID_CONFIG_VERSION,
+		.stroke_time_min = stroke_time_min,
+		.stroke_time_max = stroke_time_max,
+		.vel_curve = VEL_CURVE_LINEAR,
+		.transpose = 0,
+	};
+
+	dbg("GPIO component initializing...\n");
+
+	if ((err = key_fsm_check()) != 0) {
+		err("Invalid key transition %d\n", err - 1);
+		return -EINVAL;
 	}
 
-	return 0;
+	state->last_stroke_time = 100000;
+
+	INIT_LIST_HEAD(&state->lines);
+	ida_init(&state->line_ids);
+	mutex_init(&state->remap_mutex);
+	RCU_INIT_POINTER(state->keymap, NULL);
+
+	spin_lock_init(&state->sched_lock);
+	state->irq_thread.priority = irq_thread_priority;
+	state->irq_thread.cpu = irq_thread_cpu;
+	state->sched_gen = 0;
 
- free_buttons:
+	if ((err = cmidid_gpio_set_irq_thread(state, &state->irq_thread)) < 0) {
+		err("Invalid irq thread settings: priority %d, cpu %d\n",
+		    irq_thread_priority, irq_thread_cpu);
+		return err;
+	}
 
-	/* Free in reverse order. */
-	for (--i; i > 0; --i) {
-		gpio_free_array(state.keys[i].gpios, 2);
-		hrtimer_cancel(&state.keys[i].hrtimers[END_BUTTON]);
-		hrtimer_cancel(&state.keys[i].hrtimers[START_BUTTON]);
+	/* The configuration has to be in place before the first interrupt. */
+	if ((err = cmidid_config_init(state->config, &cfg)) < 0)
+		return err;
+
+	/* A binary keymap replaces the gpio_mapping parameter. */
+	if (keymap != NULL && keymap[0] != '\0')
+		err = cmidid_gpio_load_keymap(state, keymap);
+	else if (state->index == 0)
+		err = load_gpio_mapping(state);
+	else {
+		err("No keymap given for instance %d\n", state->index);
+		err = -EINVAL;
 	}
 
-	kfree(state.keys);
+	if (err < 0) {
+		cmidid_config_exit(state->config);
+		ida_destroy(&state->line_ids);
+		return err;
+	}
 
-	return err;
+	/* Like the statistics, the measurement is optional. */
+	if (cmidid_stats_debugfs_dir() != NULL) {
+		snprintf(name, sizeof(name), "key_scan%d", state->index);
+		state->debugfs = debugfs_create_file(name, S_IRUSR,
+						     cmidid_stats_debugfs_dir(),
+						     state, &key_scan_fops);
+	}
+
+	return 0;
 }
 
 /*
  * gpio_exit: Exit/cleanup routine called by the __exit routine of the
  * actual module. Definitely, free everything here.
+ *
+ * @state: The GPIO state of the instance.
  */
-void cmidid_gpio_exit(void)
+void cmidid_gpio_exit(struct cmidid_gpio_state *state)
 {
-	int i;
+	struct cmidid_keymap *map;
+
 	dbg("GPIO component exiting...\n");
 
-	for (i = 0; i < state.num_keys; i++) {
-		free_irq(state.keys[i].irqs[START_BUTTON], NULL);
-		free_irq(state.keys[i].irqs[END_BUTTON], NULL);
-		gpio_free_array(state.keys[i].gpios, 2);
-		hrtimer_cancel(&state.keys[i].hrtimers[END_BUTTON]);
-		hrtimer_cancel(&state.keys[i].hrtimers[START_BUTTON]);
-	}
+	debugfs_remove(state->debugfs);
+
+	mutex_lock(&state->remap_mutex);
+
+	map = rcu_dereference_protected(state->keymap,
+					lockdep_is_held(&state->remap_mutex));
+	RCU_INIT_POINTER(state->keymap, NULL);
+	synchronize_rcu();
+
+	release_keymap(state, map);
+	put_unused_lines(state, NULL);
+
+	mutex_unlock(&state->remap_mutex);
 
-	kfree(state.keys);
+	ida_destroy(&state->line_ids);
+	cmidid_config_exit(state->config);
 }
@@ -1,18 +1,98 @@
 #ifndef CMIDID_GPIO_H
 #define CMIDID_GPIO_H
 
+#include <linux/gpio.h>
+#include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+
+#include "cmidid_ioctl.h"
+
 /* Maximum number of keys that can be specified in gpio_mapping param. */
 #define MAX_KEYS 88
 
-uint32_t cmidid_set_min_stroke_time(void);
-uint32_t cmidid_set_max_stroke_time(void);
+/*
+ * Maximum number of keys of a key table set with a binary keymap or
+ * CMIDID_REMAP. Every key needs two GPIOs of its own.
+ */
+#define CMIDID_MAX_KEYS (ARCH_NR_GPIOS / 2)
+
+struct cmidid_keymap;
+struct cmidid_line;
+struct cmidid_config_state;
+struct cmidid_midi_state;
+struct cmidid_event_state;
+struct cmidid_keystate_state;
+struct dentry;
+
+/*
+ * cmidid_gpio_state:
+ *
+ * The state of the GPIO component of one instance of our kernel module.
+ * @index: the number of the instance
+ * @device: the device of the instance, used for request_firmware
+ * @config: the runtime configuration of the instance
+ * @midi: the MIDI component of the instance
+ * @events: the event ring of the instance
+ * @keystate: the key state page of the instance
+ * @keymap: the current key table; readers need rcu_read_lock
+ * @lines: all requested lines
+ * @gpio_lines: the requested line of every GPIO
+ * @line_ids: allocator for the line ids
+ * @remap_mutex: serializes remaps and protects `lines'
+ * @last_stroke_time: the time difference used for the last velocity computation; this is used for calibration
+ * @irq_thread: the priority and CPU of the IRQ threads
+ * @sched_gen: incremented on every change of `irq_thread'
+ * @sched_lock: protects `irq_thread' and `sched_gen'
+ * @debugfs: the key scan measurement in debugfs
+ *
+ * The fields up to `keystate' are set by the instance before
+ * cmidid_gpio_init. The stroke times and the velocity curve are part of the
+ * runtime configuration, see cmidid_config.c.
+ */
+struct cmidid_gpio_state {
+	int index;
+	struct device *device;
+	struct cmidid_config_state *config;
+	struct cmidid_midi_state *midi;
+	struct cmidid_event_state *events;
+	struct cmidid_keystate_state *keystate;
+	struct cmidid_keymap __rcu *keymap;
+	struct list_head lines;
+	struct cmidid_line *gpio_lines[ARCH_NR_GPIOS];
+	struct ida line_ids;
+	struct mutex remap_mutex;
+	uint32_t last_stroke_time;
+	struct cmidid_irq_thread irq_thread;
+	int sched_gen;
+	spinlock_t sched_lock;
+	struct dentry *debugfs;
+};
+
+long cmidid_set_min_stroke_time(struct cmidid_gpio_state *state);
+long cmidid_set_max_stroke_time(struct cmidid_gpio_state *state);
+
+int cmidid_set_vel_curve_linear(struct cmidid_gpio_state *state);
+int cmidid_set_vel_curve_concave(struct cmidid_gpio_state *state);
+int cmidid_set_vel_curve_convex(struct cmidid_gpio_state *state);
+int cmidid_set_vel_curve_saturated(struct cmidid_gpio_state *state);
+
+void cmidid_gpio_get_irq_thread(struct cmidid_gpio_state *state,
+				struct cmidid_irq_thread *settings);
+int cmidid_gpio_set_irq_thread(struct cmidid_gpio_state *state,
+			       const struct cmidid_irq_thread *settings);
 
-void cmidid_set_vel_curve_linear(void);
-void cmidid_set_vel_curve_concave(void);
-void cmidid_set_vel_curve_convex(void);
-void cmidid_set_vel_curve_saturated(void);
+int cmidid_gpio_remap(struct cmidid_gpio_state *state,
+		      const struct cmidid_key_mapping *mapping,
+		      unsigned int num_keys, unsigned int flags,
+		      unsigned int debounce_time);
+int cmidid_gpio_load_keymap(struct cmidid_gpio_state *state, const char *name);
+int cmidid_gpio_inject(struct cmidid_gpio_state *state,
+		       struct cmidid_inject *inject);
 
-int cmidid_gpio_init(void);
-void cmidid_gpio_exit(void);
+int cmidid_gpio_init(struct cmidid_gpio_state *state, const char *keymap);
+void cmidid_gpio_exit(struct cmidid_gpio_state *state);
 
 #endif
@@ -1,6 +1,7 @@
 #ifndef CMIDID_IOCTL_H
 #define CMIDID_IOCTL_H
 
+#include <linux/types.h>
 #include <asm/ioctl.h>
 
 #define CMIDID_CALIBRATE_MIN_TIME _IO(0, 0)
@@ -13,4 +14,303 @@
 
 #define CMIDID_TRANSPOSE _IO(0, 6)
 
+/*
+ * VEL_CURVE: The types of interpolation curves used to calculate the
+ * velocity for MIDI note_on events.
+ */
+typedef enum {
+	VEL_CURVE_LINEAR,
+	VEL_CURVE_CONCAVE,
+	VEL_CURVE_CONVEX,
+	VEL_CURVE_SATURATED,
+} VEL_CURVE;
+
+/*
+ * Possible states for every key of our MIDI keyboard.
+ * These values are used in `handle_button_event'.
+ *
+ * @KEY_INACTIVE: The key is not touched or pressed.
+ * @KEY_TOUCHED: The first button of the key is activated. The key started to move.
+ * @KEY_PRESSED: The second button is hit, so the key is completely pressed.
+ */
+typedef enum {
+	KEY_INACTIVE,
+	KEY_TOUCHED,
+	KEY_PRESSED
+} KEY_STATE;
+
+/*
+ * Version of the layout of struct cmidid_config. Userspace has to set
+ * the `version' field to this value, otherwise CMIDID_SET_CONFIG fails
+ * with -EINVAL.
+ */
+#define CMIDID_CONFIG_VERSION 1
+
+/*
+ * struct cmidid_config:
+ *
+ * The complete runtime configuration of the module. It is read and written
+ * as a whole with CMIDID_GET_CONFIG and CMIDID_SET_CONFIG, so a complete
+ * preset can be switched in a single call.
+ *
+ * @version: must be CMIDID_CONFIG_VERSION
+ * @generation: incremented by the module on every change; ignored on set
+ * @stroke_time_min: stroke time (in 2^10 ns) for the maximal velocity
+ * @stroke_time_max: stroke time (in 2^10 ns) for the minimal velocity
+ * @vel_curve: one of VEL_CURVE
+ * @transpose: value in semitones added to every note (-127 to 127)
+ */
+struct cmidid_config {
+	__u32 version;
+	__u32 generation;
+	__u32 stroke_time_min;
+	__u32 stroke_time_max;
+	__u32 vel_curve;
+	__s32 transpose;
+};
+
+#define CMIDID_GET_CONFIG _IOR(0, 7, struct cmidid_config)
+#define CMIDID_SET_CONFIG _IOW(0, 8, struct cmidid_config)
+
+/*
+ * Offset (in bytes) to pass to mmap() on /dev/cmidid<N> to map the event ring.
+ * The mapping must be read-only. It starts with a struct
+ * cmidid_event_ring_header followed by `num_records' struct cmidid_event
+ * at `data_offset'.
+ */
+#define CMIDID_MMAP_EVENT_RING 0
+
+#define CMIDID_EVENT_RING_VERSION 1
+
+/*
+ * struct cmidid_event_ring_header:
+ *
+ * The first page of the event ring mapping.
+ *
+ * @version: CMIDID_EVENT_RING_VERSION
+ * @record_size: sizeof(struct cmidid_event)
+ * @num_records: number of records in the ring; always a power of two
+ * @data_offset: offset of the first record from the start of the mapping
+ * @head: sequence number of the next record to be written. The record with
+ * the sequence number `seq' is stored at index `seq & (num_records - 1)'.
+ */
+struct cmidid_event_ring_header {
+	__u32 version;
+	__u32 record_size;
+	__u32 num_records;
+	__u32 data_offset;
+	__u32 head;
+};
+
+/*
+ * struct cmidid_event:
+ *
+ * A single record of the event ring, written on every button event.
+ * A record is only valid while its `seq' equals the sequence number the
+ * reader expects. Readers have to check `seq' before and after copying a
+ * record, since the writer may overwrite it at any time.
+ *
+ * @timestamp: time of the edge which started the debouncing of the button
+ * event (ktime_get, in ns)
+ * @stroke_time: time between start and end button (in 2^10 ns); only set
+ * for the transition to KEY_PRESSED, zero otherwise
+ * @seq: sequence number of this record
+ * @key: index of the key in the key table
+ * @button: 0 for the start button, 1 for the end button
+ * @active: 1 if the button was pressed, 0 if it was released
+ * @old_state: KEY_STATE before the event
+ * @new_state: KEY_STATE after the event
+ * @velocity: velocity of the note_on sent for this event; zero otherwise
+ * @note: the (untransposed) note of the key
+ * @delay: time from `timestamp' until the event was handled, i.e. the
+ * debouncing and the wakeup of the IRQ thread (in ns)
+ */
+struct cmidid_event {
+	__u64 timestamp;
+	__u32 stroke_time;
+	__u32 seq;
+	__u16 key;
+	__u8 button;
+	__u8 active;
+	__u8 old_state;
+	__u8 new_state;
+	__u8 velocity;
+	__u8 note;
+	__u32 delay;
+	__u32 reserved;
+};
+
+/*
+ * Offset (in bytes) to pass to mmap() on /dev/cmidid<N> to map the key state
+ * page. The mapping must be read-only and exactly one page long. It
+ * contains a struct cmidid_key_state_page.
+ */
+#define CMIDID_MMAP_KEY_STATE 0x10000000
+
+/* Maximum number of keys covered by the key state page. */
+#define CMIDID_KEY_STATE_MAX_KEYS 1024
+
+/*
+ * struct cmidid_key_state_page:
+ *
+ * The current state of every key. Bit `i % 32' of word `i / 32' in the
+ * bitmaps belongs to the key with index i.
+ *
+ * The page is protected by a sequence counter: `seq' is odd while the page
+ * is being updated. To take a consistent snapshot read `seq', copy the
+ * values and read `seq' again. The snapshot is valid if both values are
+ * equal and even; retry otherwise.
+ *
+ * @seq: the sequence counter
+ * @num_keys: the number of keys in the key table
+ * @touched: keys in KEY_TOUCHED
+ * @pressed: keys in KEY_PRESSED
+ * @velocity: the velocity of the last note_on of each key
+ */
+struct cmidid_key_state_page {
+	__u32 seq;
+	__u32 num_keys;
+	__u32 touched[CMIDID_KEY_STATE_MAX_KEYS / 32];
+	__u32 pressed[CMIDID_KEY_STATE_MAX_KEYS / 32];
+	__u8 velocity[CMIDID_KEY_STATE_MAX_KEYS];
+};
+
+/*
+ * struct cmidid_irq_thread:
+ *
+ * Scheduling settings of the IRQ threads which debounce the buttons and
+ * send the MIDI events.
+ *
+ * @priority: SCHED_FIFO priority (1 to 99); 0 for SCHED_OTHER
+ * @cpu: the CPU to bind the threads and interrupts to; -1 for any CPU
+ */
+struct cmidid_irq_thread {
+	__s32 priority;
+	__s32 cpu;
+};
+
+#define CMIDID_GET_IRQ_THREAD _IOR(0, 9, struct cmidid_irq_thread)
+#define CMIDID_SET_IRQ_THREAD _IOW(0, 10, struct cmidid_irq_thread)
+
+/* Value of the per-key `channel' and `curve' fields to use the default. */
+#define CMIDID_KEY_DEFAULT 0xff
+
+/*
+ * struct cmidid_key_mapping: The GPIOs and the note of a single key.
+ *
+ * @gpios: the GPIO of the start and of the end button
+ * @note: the MIDI note of the key (0 to 127)
+ * @channel: the MIDI channel of the key (0 to 15); CMIDID_KEY_DEFAULT for the
+ * `midi_channel' parameter. Keys with a common channel form a zone.
+ * @curve: the VEL_CURVE of the key; CMIDID_KEY_DEFAULT for the curve of the
+ * configuration
+ */
+struct cmidid_key_mapping {
+	__s32 gpios[2];
+	__u8 note;
+	__u8 channel;
+	__u8 curve;
+	__u8 reserved;
+};
+
+#define CMIDID_REMAP_START_ACTIVE_HIGH (1 << 0)
+#define CMIDID_REMAP_END_ACTIVE_HIGH (1 << 1)
+
+/*
+ * struct cmidid_remap:
+ *
+ * A new key table for CMIDID_REMAP. The table replaces the current one
+ * without reloading the module; keys which sound at that moment get a
+ * note_off.
+ *
+ * @num_keys: the number of keys; at most half the number of GPIOs
+ * @flags: CMIDID_REMAP_START_ACTIVE_HIGH and CMIDID_REMAP_END_ACTIVE_HIGH
+ * @keys: pointer to an array of `num_keys' struct cmidid_key_mapping
+ */
+struct cmidid_remap {
+	__u32 num_keys;
+	__u32 flags;
+	__u64 keys;
+};
+
+#define CMIDID_REMAP _IOW(0, 11, struct cmidid_remap)
+
+/*
+ * Binary keymap, loaded with request_firmware() from the `keymap' module
+ * parameter or CMIDID_LOAD_KEYMAP. It consists of a struct
+ * cmidid_keymap_header followed by `num_keys' struct cmidid_keymap_record.
+ * All values are little endian.
+ */
+#define CMIDID_KEYMAP_MAGIC 0x4d4b4d43	/* "CMKM" */
+#define CMIDID_KEYMAP_VERSION 1
+
+/*
+ * struct cmidid_keymap_header:
+ *
+ * @magic: CMIDID_KEYMAP_MAGIC
+ * @version: CMIDID_KEYMAP_VERSION
+ * @num_keys: the number of records following the header
+ * @flags: CMIDID_REMAP_START_ACTIVE_HIGH and CMIDID_REMAP_END_ACTIVE_HIGH
+ * @debounce_time: time (in ns) to ignore further interrupts of a button;
+ * 0 for the `jitter_res_time' parameter
+ * @stroke_time_min: stroke time (in 2^10 ns) for the maximal velocity;
+ * 0 to keep the current value
+ * @stroke_time_max: stroke time (in 2^10 ns) for the minimal velocity;
+ * 0 to keep the current value
+ * @vel_curve: the default VEL_CURVE; CMIDID_KEY_DEFAULT to keep the current
+ * curve
+ */
+struct cmidid_keymap_header {
+	__le32 magic;
+	__le32 version;
+	__le32 num_keys;
+	__le32 flags;
+	__le32 debounce_time;
+	__le32 stroke_time_min;
+	__le32 stroke_time_max;
+	__le32 vel_curve;
+};
+
+/*
+ * struct cmidid_keymap_record: A single key of a binary keymap. The fields
+ * have the same meaning as in struct cmidid_key_mapping.
+ */
+struct cmidid_keymap_record {
+	__le16 gpios[2];
+	__u8 note;
+	__u8 channel;
+	__u8 curve;
+	__u8 reserved;
+};
+
+/*
+ * struct cmidid_keymap_name: The name of a binary keymap, relative to the
+ * firmware search path (usually /lib/firmware).
+ */
+struct cmidid_keymap_name {
+	char name[64];
+};
+
+#define CMIDID_LOAD_KEYMAP _IOW(0, 12, struct cmidid_keymap_name)
+
+/*
+ * struct cmidid_inject:
+ *
+ * A simulated edge for CMIDID_INJECT. The edge takes the same path as an
+ * interrupt of the GPIO, including debouncing; afterwards the module reads
+ * the simulated level instead of the GPIO. Only available if the module
+ * was loaded with allow_inject=1.
+ *
+ * @gpio: a GPIO of the key table
+ * @level: the new level of the GPIO (0 or 1); -1 to read the GPIO again
+ * @timestamp: set by the module to the time of the edge (ktime_get, in ns)
+ */
+struct cmidid_inject {
+	__s32 gpio;
+	__s32 level;
+	__u64 timestamp;
+};
+
+#define CMIDID_INJECT _IOWR(0, 13, struct cmidid_inject)
+
 #endif
@@ -0,0 +1,174 @@
+#ifndef CMIDID_KEYFSM_H
+#define CMIDID_KEYFSM_H
+
+/*
+ * The state machine of a key. This header has no dependencies besides
+ * cmidid_ioctl.h, so it can be used and checked outside the kernel as well.
+ */
+
+#include "cmidid_ioctl.h"
+
+/*
+ * START_BUTTON and END_BUTTON are used to index the GPIO buttons
+ * in every key struct. START_BUTTON is the id for the button
+ * which is hit first when the keyboard key starts to move.
+ * The END_BUTTON is hit, when the key is completely pressed down.
+ * Somwhat like this:
+ *
+ *   |  |
+ *   v  v  v
+ *  +--------------+
+ *  | keyboard key | The key is fixed on this side :)
+ *  +..............+=========
+ *
+ *   .---.    .---.
+ *    end     start
+ *
+ * Example usage: map->setup[i].gpios[START_BUTTON] ...
+ */
+#define START_BUTTON 0
+#define END_BUTTON 1
+
+#define KEY_NR_STATES (KEY_PRESSED + 1)
+
+/*
+ * Actions of a transition. They are executed in this order.
+ *
+ * @KEY_ACTION_NOTE_OFF: send a note_off
+ * @KEY_ACTION_HIT: remember the current time as hit time
+ * @KEY_ACTION_MEASURE: compute the velocity from the hit time
+ * @KEY_ACTION_NOTE_ON: send a note_on with the last velocity
+ */
+#define KEY_ACTION_NOTE_OFF (1 << 0)
+#define KEY_ACTION_HIT (1 << 1)
+#define KEY_ACTION_MEASURE (1 << 2)
+#define KEY_ACTION_NOTE_ON (1 << 3)
+
+/*
+ * struct key_transition:
+ *
+ * @next: the KEY_STATE after the transition
+ * @actions: the KEY_ACTION_* to execute
+ */
+struct key_transition {
+	unsigned char next;
+	unsigned char actions;
+};
+
+/*
+ * key_transitions: The transition for every state, button and level
+ * (1 if the button is pressed). Every entry has to be given explicitly.
+ */
+static const struct key_transition
+    key_transitions[KEY_NR_STATES][2][2] = {
+	/* The key is not touched or pressed. */
+	[KEY_INACTIVE][START_BUTTON][0] = {KEY_INACTIVE, 0},
+	[KEY_INACTIVE][START_BUTTON][1] = {KEY_TOUCHED, KEY_ACTION_HIT},
+	[KEY_INACTIVE][END_BUTTON][0] = {KEY_INACTIVE, 0},
+	[KEY_INACTIVE][END_BUTTON][1] = {KEY_INACTIVE, 0},
+
+	/* Only the start button was hit; the key is moving. */
+	[KEY_TOUCHED][START_BUTTON][0] = {KEY_INACTIVE, 0},
+	[KEY_TOUCHED][START_BUTTON][1] = {KEY_TOUCHED, 0},
+	[KEY_TOUCHED][END_BUTTON][0] = {KEY_TOUCHED, 0},
+	[KEY_TOUCHED][END_BUTTON][1] = {KEY_PRESSED,
+					KEY_ACTION_MEASURE |
+					KEY_ACTION_NOTE_ON},
+
+	/* The key is completely pressed down and sounds. */
+	[KEY_PRESSED][START_BUTTON][0] = {KEY_INACTIVE, KEY_ACTION_NOTE_OFF},
+	[KEY_PRESSED][START_BUTTON][1] = {KEY_PRESSED, 0},
+	[KEY_PRESSED][END_BUTTON][0] = {KEY_PRESSED, 0},
+	/* The end button was hit again: repeat the note. */
+	[KEY_PRESSED][END_BUTTON][1] = {KEY_PRESSED,
+					KEY_ACTION_NOTE_OFF |
+					KEY_ACTION_NOTE_ON},
+};
+
+/*
+ * key_transition: Looks up the transition of a key.
+ *
+ * @state: the current KEY_STATE; must be valid
+ * @button: START_BUTTON or END_BUTTON
+ * @active: nonzero if the button was pressed
+ */
+static inline struct key_transition key_transition(unsigned int state,
+						   unsigned int button,
+						   int active)
+{
+	return key_transitions[state][button][!!active];
+}
+
+/*
+ * key_sounds: Returns 1 if a key in the given state sounds, i.e. a note_on
+ * was sent for it without a note_off.
+ */
+static inline int key_sounds(unsigned int state)
+{
+	return state == KEY_PRESSED;
+}
+
+/*
+ * key_fsm_check: Verifies the transition table. Since a key sounds exactly
+ * in the states for which key_sounds returns 1, checking every transition
+ * once covers all input sequences:
+ *
+ * - every next state is valid,
+ * - a note_off is only sent for a sounding key,
+ * - a note_on is only sent for a silent key (after a note_off, if any),
+ * - a velocity is only measured after a hit and before it is used,
+ * - the key sounds after the transition exactly if the next state sounds.
+ *
+ * Return: 0 if the table is valid; otherwise the index of the first
+ * invalid entry plus one.
+ */
+static inline int key_fsm_check(void)
+{
+	struct key_transition t;
+	unsigned int state, button;
+	int active, sounds;
+
+	for (state = 0; state < KEY_NR_STATES; state++)
+		for (button = START_BUTTON; button <= END_BUTTON; button++)
+			for (active = 0; active <= 1; active++) {
+				t = key_transition(state, button, active);
+				sounds = key_sounds(state);
+
+				if (t.next >= KEY_NR_STATES)
+					goto invalid;
+
+				if (t.actions & KEY_ACTION_NOTE_OFF) {
+					if (!sounds)
+						goto invalid;
+					sounds = 0;
+				}
+
+				/* KEY_TOUCHED is only entered with a hit. */
+				if (t.next == KEY_TOUCHED && state != KEY_TOUCHED
+				    && !(t.actions & KEY_ACTION_HIT))
+					goto invalid;
+
+				if ((t.actions & KEY_ACTION_MEASURE)
+				    && state != KEY_TOUCHED)
+					goto invalid;
+
+				if (t.actions & KEY_ACTION_NOTE_ON) {
+					if (sounds
+					    || !(t.actions & (KEY_ACTION_MEASURE
+							      | KEY_ACTION_NOTE_OFF)))
+						goto invalid;
+					sounds = 1;
+				}
+
+				if (sounds != key_sounds(t.next))
+					goto invalid;
+
+				continue;
+ invalid:
+				return (state * 2 + button) * 2 + active + 1;
+			}
+
+	return 0;
+}
+
+#endif
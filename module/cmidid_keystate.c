@@ -0,0 +1,147 @@
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/bug.h>
+
+#include "cmidid_util.h"
+#include "cmidid_keystate.h"
+
+/*
+ * write_begin/write_end: The writer side of the sequence counter in the
+ * shared page. This is the same protocol as write_seqcount_begin/end, but
+ * the counter has to live in the page itself so userspace can read it.
+ */
+static void write_begin(struct cmidid_key_state_page *page)
+{
+	ACCESS_ONCE(page->seq) = page->seq + 1;
+	smp_wmb();
+}
+
+static void write_end(struct cmidid_key_state_page *page)
+{
+	smp_wmb();
+	ACCESS_ONCE(page->seq) = page->seq + 1;
+}
+
+/*
+ * cmidid_keystate_update: Publish the new state of a key. May be called
+ * from any context.
+ *
+ * @state: The key state page of the instance.
+ * @key: the index of the key; keys beyond CMIDID_KEY_STATE_MAX_KEYS are
+ * ignored
+ * @key_state: the new state of the key
+ * @velocity: the velocity of the last note_on of the key
+ */
+void cmidid_keystate_update(struct cmidid_keystate_state *state,
+			    unsigned int key, KEY_STATE key_state,
+			    unsigned char velocity)
+{
+	struct cmidid_key_state_page *page = state->page;
+	unsigned int word = key / 32;
+	u32 bit = 1U << (key % 32);
+	unsigned long flags;
+
+	if (page == NULL || key >= CMIDID_KEY_STATE_MAX_KEYS)
+		return;
+
+	spin_lock_irqsave(&state->lock, flags);
+	write_begin(page);
+
+	if (key_state == KEY_TOUCHED)
+		page->touched[word] |= bit;
+	else
+		page->touched[word] &= ~bit;
+
+	if (key_state == KEY_PRESSED)
+		page->pressed[word] |= bit;
+	else
+		page->pressed[word] &= ~bit;
+
+	page->velocity[key] = velocity;
+
+	write_end(page);
+	spin_unlock_irqrestore(&state->lock, flags);
+}
+
+/*
+ * cmidid_keystate_set_num_keys: Reset the page for a new key table.
+ *
+ * @state: The key state page of the instance.
+ * @num_keys: the number of keys of the key table
+ */
+void cmidid_keystate_set_num_keys(struct cmidid_keystate_state *state,
+				  unsigned int num_keys)
+{
+	struct cmidid_key_state_page *page = state->page;
+	unsigned long flags;
+
+	if (page == NULL)
+		return;
+
+	spin_lock_irqsave(&state->lock, flags);
+	write_begin(page);
+
+	memset(page->touched, 0, sizeof(page->touched));
+	memset(page->pressed, 0, sizeof(page->pressed));
+	memset(page->velocity, 0, sizeof(page->velocity));
+	page->num_keys = num_keys;
+
+	write_end(page);
+	spin_unlock_irqrestore(&state->lock, flags);
+}
+
+/*
+ * cmidid_keystate_mmap: Maps the key state page read-only into a process.
+ *
+ * @state: The key state page of the instance the file belongs to.
+ * @vma: the mapping; must start at CMIDID_MMAP_KEY_STATE and be one page
+ *
+ * Return: 0 on success; a negative error code otherwise.
+ */
+int cmidid_keystate_mmap(struct cmidid_keystate_state *state,
+			 struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != CMIDID_MMAP_KEY_STATE >> PAGE_SHIFT)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, state->page, 0);
+}
+
+/*
+ * cmidid_keystate_init: Allocates the key state page.
+ *
+ * @state: The key state page of the instance.
+ *
+ * Return: 0 on success; -ENOMEM otherwise.
+ */
+int cmidid_keystate_init(struct cmidid_keystate_state *state)
+{
+	BUILD_BUG_ON(sizeof(struct cmidid_key_state_page) > PAGE_SIZE);
+
+	spin_lock_init(&state->lock);
+
+	state->page = vmalloc_user(PAGE_SIZE);
+	if (state->page == NULL) {
+		err("Failed to allocate key state page\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * cmidid_keystate_exit: Frees the key state page.
+ *
+ * @state: The key state page of the instance.
+ */
+void cmidid_keystate_exit(struct cmidid_keystate_state *state)
+{
+	vfree(state->page);
+	state->page = NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef CMIDID_KEYSTATE_H
+#define CMIDID_KEYSTATE_H
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+
+#include "cmidid_ioctl.h"
+
+/*
+ * cmidid_keystate_state:
+ *
+ * The key state page of one instance, shared read-only with userspace.
+ *
+ * @lock: serializes writers; readers only use the sequence counter
+ * @page: the shared page
+ */
+struct cmidid_keystate_state {
+	spinlock_t lock;
+	struct cmidid_key_state_page *page;
+};
+
+void cmidid_keystate_update(struct cmidid_keystate_state *state,
+			    unsigned int key, KEY_STATE key_state,
+			    unsigned char velocity);
+void cmidid_keystate_set_num_keys(struct cmidid_keystate_state *state,
+				  unsigned int num_keys);
+
+int cmidid_keystate_mmap(struct cmidid_keystate_state *state,
+			 struct vm_area_struct *vma);
+
+int cmidid_keystate_init(struct cmidid_keystate_state *state);
+void cmidid_keystate_exit(struct cmidid_keystate_state *state);
+
+#endif
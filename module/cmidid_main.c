@@ -3,10 +3,21 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "cmidid_main.h"
 #include "cmidid_util.h"
 #include "cmidid_ioctl.h"
+#include "cmidid_config.h"
+#include "cmidid_event.h"
+#include "cmidid_keystate.h"
+#include "cmidid_stats.h"
+#include "cmidid_selftest.h"
+
+#define CREATE_TRACE_POINTS
+#include "cmidid_trace.h"
 #include "cmidid_midi.h"
 #include "cmidid_gpio.h"
 
@@ -20,79 +31,229 @@ static void __exit cmidid_exit(void);
 module_init(cmidid_init);
 module_exit(cmidid_exit);
 
+/*
+ * Names of the binary keymaps in the firmware directory, one per instance.
+ * The number of keymaps determines the number of instances. Without any
+ * keymap a single instance is created from the `gpio_mapping' parameter.
+ */
+static char *keymap[CMIDID_MAX_INSTANCES];
+static int keymap_size;
+module_param_array(keymap, charp, &keymap_size, 0);
+MODULE_PARM_DESC(keymap,
+		 "Binary keymaps to load from the firmware directory, one per instance.");
+
+/*
+ * struct cmidid_instance:
+ *
+ * One independent keyboard. The components of an instance only share the
+ * module parameters and the statistics with other instances.
+ *
+ * @index: the number of the instance; N in /dev/cmidid<N>
+ * @cdev: the character device of the instance
+ * @device: the device of /dev/cmidid<N>
+ * @config: the runtime configuration
+ * @midi: the sound card and sequencer client
+ * @events: the event ring
+ * @keystate: the key state page
+ * @gpio: the key table and its GPIOs
+ */
+struct cmidid_instance {
+	int index;
+	struct cdev cdev;
+	struct device *device;
+	struct cmidid_config_state config;
+	struct cmidid_midi_state midi;
+	struct cmidid_event_state events;
+	struct cmidid_keystate_state keystate;
+	struct cmidid_gpio_state gpio;
+};
+
+static int cmidid_open(struct inode *inode, struct file *f);
+static int cmidid_release(struct inode *inode, struct file *f);
 static long cmidid_ioctl(struct file *f, unsigned int cmd, unsigned long arg);
+static int cmidid_mmap(struct file *f, struct vm_area_struct *vma);
 
-/* We are only using ioctl and not read, write, etc. */
+/*
+ * We are using ioctl for configuration and mmap/poll for the event ring
+ * and the key state page; there is no read, write, etc.
+ */
 static struct file_operations cmidid_fops = {
+	.owner = THIS_MODULE,
+	.open = cmidid_open,
+	.release = cmidid_release,
+	.mmap = cmidid_mmap,
+	.poll = cmidid_event_poll,
 	.unlocked_ioctl = cmidid_ioctl,
 };
 
 static dev_t cmidid_dev_number;
-static struct cdev *cmidid_driver_object;
 static struct class *cmidid_class;
+static struct cmidid_instance *instances[CMIDID_MAX_INSTANCES];
+static int num_instances;
 struct device *cmidid_device;
 
 /*
- * cmidid_inti: Init routine; called by the kernel.
+ * instance_create: Creates an instance with all of its components and its
+ * device node. The node is added last, so userspace never sees a half
+ * initialized instance.
  *
- * Return: An appropriate Linux error code.
+ * @index: The number of the instance.
+ *
+ * Return: The instance or an ERR_PTR.
  */
-static int __init cmidid_init(void)
+static struct cmidid_instance *instance_create(int index)
 {
+	struct cmidid_instance *inst;
+	dev_t devt = MKDEV(MAJOR(cmidid_dev_number), index);
 	int err;
-	pr_debug("Module initializing...\n");
 
-	if (alloc_chrdev_region(&cmidid_dev_number, 0, 1, IOCTL_DEV_NAME) < 0) {
-		pr_err("error allocating character device region\n");
-		return -EIO;
-	}
+	inst = kzalloc(sizeof(*inst), GFP_KERNEL);
+	if (inst == NULL)
+		return ERR_PTR(-ENOMEM);
 
-	cmidid_driver_object = cdev_alloc();
-	if (cmidid_driver_object == NULL) {
-		pr_err("error allocating character device\n");
-		err = -EIO;
-		goto free_device_number;
-	}
-	cmidid_driver_object->owner = THIS_MODULE;
-	cmidid_driver_object->ops = &cmidid_fops;
+	inst->index = index;
 
-	if (cdev_add(cmidid_driver_object, cmidid_dev_number, 1)) {
-		pr_err("error adding character device\n");
-		err = -EIO;
-		goto free_cdev;
+	inst->device = device_create(cmidid_class, NULL, devt, inst,
+				     IOCTL_DEV_NAME "%d", index);
+	if (IS_ERR(inst->device)) {
+		err = PTR_ERR(inst->device);
+		pr_err("error creating device %d\n", index);
+		goto free_instance;
 	}
 
-	cmidid_class = class_create(THIS_MODULE, IOCTL_DEV_NAME);
+	/* The first instance is used for all module wide messages. */
+	if (index == 0)
+		cmidid_device = inst->device;
 
-	cmidid_device =
-	    device_create(cmidid_class, NULL, cmidid_dev_number, NULL, "%s",
-			  IOCTL_DEV_NAME);
-	if ((err = cmidid_midi_init()) < 0) {
+	if ((err = cmidid_midi_init(&inst->midi, index)) < 0) {
 		err("%d. Could not initialize MIDI component.\n", err);
 		goto err_midi_init;
 	}
 
-	if ((err = cmidid_gpio_init()) < 0) {
+	if ((err = cmidid_event_init(&inst->events)) < 0) {
+		err("%d. Could not initialize event ring.\n", err);
+		goto err_event_init;
+	}
+
+	if ((err = cmidid_keystate_init(&inst->keystate)) < 0) {
+		err("%d. Could not initialize key state page.\n", err);
+		goto err_keystate_init;
+	}
+
+	inst->gpio.index = index;
+	inst->gpio.device = inst->device;
+	inst->gpio.config = &inst->config;
+	inst->gpio.midi = &inst->midi;
+	inst->gpio.events = &inst->events;
+	inst->gpio.keystate = &inst->keystate;
+
+	if ((err = cmidid_gpio_init(&inst->gpio, index < keymap_size ?
+				    keymap[index] : NULL)) < 0) {
 		err("%d. Could not initialize GPIO component.\n", err);
 		goto err_gpio_init;
 	}
 
-	return 0;
+	cdev_init(&inst->cdev, &cmidid_fops);
+	inst->cdev.owner = THIS_MODULE;
+
+	if ((err = cdev_add(&inst->cdev, devt, 1)) < 0) {
+		err("error adding character device\n");
+		goto err_cdev_add;
+	}
+
+	return inst;
 
 /* Call exit/cleanup routines in reverse order. */
+ err_cdev_add:
+	cmidid_gpio_exit(&inst->gpio);
+
  err_gpio_init:
-	cmidid_midi_exit();
+	cmidid_keystate_exit(&inst->keystate);
+
+ err_keystate_init:
+	cmidid_event_exit(&inst->events);
+
+ err_event_init:
+	cmidid_midi_exit(&inst->midi);
 
  err_midi_init:
-	device_destroy(cmidid_class, cmidid_dev_number);
-	class_destroy(cmidid_class);
-	cdev_del(cmidid_driver_object);
+	if (index == 0)
+		cmidid_device = NULL;
+	device_destroy(cmidid_class, devt);
+
+ free_instance:
+	kfree(inst);
+
+	return ERR_PTR(err);
+}
+
+/*
+ * instance_destroy: Removes the device node of an instance and frees all
+ * of its components.
+ *
+ * @inst: The instance.
+ */
+static void instance_destroy(struct cmidid_instance *inst)
+{
+	cdev_del(&inst->cdev);
+	cmidid_gpio_exit(&inst->gpio);
+	cmidid_keystate_exit(&inst->keystate);
+	cmidid_event_exit(&inst->events);
+	cmidid_midi_exit(&inst->midi);
+	if (inst->index == 0)
+		cmidid_device = NULL;
+	device_destroy(cmidid_class, inst->cdev.dev);
+	kfree(inst);
+}
 
- free_cdev:
-	kobject_put(&cmidid_driver_object->kobj);
+/*
+ * cmidid_inti: Init routine; called by the kernel.
+ *
+ * Return: An appropriate Linux error code.
+ */
+static int __init cmidid_init(void)
+{
+	int err, i;
+	pr_debug("Module initializing...\n");
+
+	num_instances = max(keymap_size, 1);
+
+	if (alloc_chrdev_region(&cmidid_dev_number, 0, num_instances,
+				IOCTL_DEV_NAME) < 0) {
+		pr_err("error allocating character device region\n");
+		return -EIO;
+	}
+
+	cmidid_class = class_create(THIS_MODULE, IOCTL_DEV_NAME);
+	if (IS_ERR(cmidid_class)) {
+		pr_err("error creating device class\n");
+		err = PTR_ERR(cmidid_class);
+		goto free_device_number;
+	}
+
+	cmidid_stats_init();
+	cmidid_selftest_init();
+
+	for (i = 0; i < num_instances; i++) {
+		instances[i] = instance_create(i);
+		if (IS_ERR(instances[i])) {
+			err = PTR_ERR(instances[i]);
+			pr_err("%d. Could not create instance %d.\n", err, i);
+			goto destroy_instances;
+		}
+	}
+
+	return 0;
+
+ destroy_instances:
+	while (--i >= 0)
+		instance_destroy(instances[i]);
+	cmidid_selftest_exit();
+	cmidid_stats_exit();
+	class_destroy(cmidid_class);
 
  free_device_number:
-	unregister_chrdev_region(cmidid_dev_number, 1);
+	unregister_chrdev_region(cmidid_dev_number, num_instances);
 
 	return err;
 }
@@ -105,52 +266,172 @@ static int __init cmidid_init(void)
  */
 static void __exit cmidid_exit(void)
 {
+	int i;
+
 	dbg("Module exiting...\n");
 
-	cmidid_gpio_exit();
-	cmidid_midi_exit();
+	/* Instance 0 is destroyed last, it provides `cmidid_device'. */
+	for (i = num_instances - 1; i >= 0; i--)
+		instance_destroy(instances[i]);
+
+	cmidid_selftest_exit();
+	cmidid_stats_exit();
 
-	dbg("Unregistering char device\n");
-	/* Delete Sysfs entry and device file  */
-	device_destroy(cmidid_class, cmidid_dev_number);
 	class_destroy(cmidid_class);
-	/* Deletion of driver */
-	cdev_del(cmidid_driver_object);
-	unregister_chrdev_region(cmidid_dev_number, 1);
+	unregister_chrdev_region(cmidid_dev_number, num_instances);
+}
+
+/*
+ * file_instance: Returns the instance an open file belongs to.
+ *
+ * @f: pointer to cmidid file; /dev/cmidid<N>
+ */
+static struct cmidid_instance *file_instance(struct file *f)
+{
+	return container_of(file_inode(f)->i_cdev, struct cmidid_instance,
+			    cdev);
+}
+
+/*
+ * cmidid_open: open callback function. Sets up the event ring state of
+ * the file.
+ *
+ * Returns: 0 on success; a negative error code otherwise.
+ */
+static int cmidid_open(struct inode *inode, struct file *f)
+{
+	struct cmidid_instance *inst =
+	    container_of(inode->i_cdev, struct cmidid_instance, cdev);
+
+	return cmidid_event_open(&inst->events, f);
+}
+
+/*
+ * cmidid_release: release callback function.
+ *
+ * Returns: 0
+ */
+static int cmidid_release(struct inode *inode, struct file *f)
+{
+	return cmidid_event_release(f);
+}
+
+/*
+ * cmidid_mmap: mmap callback function. The offset selects which area
+ * is mapped: CMIDID_MMAP_EVENT_RING or CMIDID_MMAP_KEY_STATE.
+ *
+ * @f: pointer to cmidid file; /dev/cmidid<N>
+ * @vma: the mapping to set up
+ *
+ * Returns: 0 on success; a negative error code otherwise.
+ */
+static int cmidid_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case CMIDID_MMAP_EVENT_RING:
+		return cmidid_event_mmap(f, vma);
+	case CMIDID_MMAP_KEY_STATE:
+		return cmidid_keystate_mmap(&file_instance(f)->keystate, vma);
+	default:
+		dbg("unknown mmap offset\n");
+		return -EINVAL;
+	}
 }
 
 /*
  * cmidid_ioctl: ioctl callback function.
  *
- * @f: pointer to cmidid file; /dev/cmidid
+ * @f: pointer to cmidid file; /dev/cmidid<N>
  * @cmd: ioctl command encoded in a single byte.
  * @arg: unspecified number of additional arguments
  *
- * Returns: 0 if the command handling was successful;
+ * Returns: 0 if the command handling was successful; a negative error code
+ * otherwise.
  */
 static long cmidid_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
+	struct cmidid_instance *inst = file_instance(f);
+	struct cmidid_config cfg;
+	struct cmidid_irq_thread irq_thread;
+	struct cmidid_remap remap;
+	struct cmidid_key_mapping *mapping;
+	struct cmidid_keymap_name keymap;
+	struct cmidid_inject inject;
+	int err, transpose;
 
 	dbg("ioctl called with: %d\n", cmd);
 	switch (cmd) {
 	case CMIDID_CALIBRATE_MIN_TIME:
-		return cmidid_set_min_stroke_time();
+		return cmidid_set_min_stroke_time(&inst->gpio);
 	case CMIDID_CALIBRATE_MAX_TIME:
-		return cmidid_set_max_stroke_time();
+		return cmidid_set_max_stroke_time(&inst->gpio);
 	case CMIDID_VEL_CURVE_LINEAR:
-		cmidid_set_vel_curve_linear();
-		break;
+		return cmidid_set_vel_curve_linear(&inst->gpio);
 	case CMIDID_VEL_CURVE_CONCAVE:
-		cmidid_set_vel_curve_concave();
-		break;
+		return cmidid_set_vel_curve_concave(&inst->gpio);
 	case CMIDID_VEL_CURVE_CONVEX:
-		cmidid_set_vel_curve_convex();
-		break;
+		return cmidid_set_vel_curve_convex(&inst->gpio);
 	case CMIDID_VEL_CURVE_SATURATED:
-		cmidid_set_vel_curve_saturated();
-		break;
+		return cmidid_set_vel_curve_saturated(&inst->gpio);
 	case CMIDID_TRANSPOSE:
-		return cmidid_transpose((signed char)arg) + 128;
+		/* Legacy interface: the result is offset by 128. */
+		if ((err = cmidid_transpose(&inst->config, (signed char)arg,
+					    &transpose)) < 0)
+			return err;
+		return transpose + 128;
+	case CMIDID_GET_CONFIG:
+		cmidid_config_get(&inst->config, &cfg);
+		if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+			return -EFAULT;
+		break;
+	case CMIDID_SET_CONFIG:
+		if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		return cmidid_config_set(&inst->config, &cfg);
+	case CMIDID_GET_IRQ_THREAD:
+		cmidid_gpio_get_irq_thread(&inst->gpio, &irq_thread);
+		if (copy_to_user((void __user *)arg, &irq_thread,
+				 sizeof(irq_thread)))
+			return -EFAULT;
+		break;
+	case CMIDID_SET_IRQ_THREAD:
+		if (!capable(CAP_SYS_NICE))
+			return -EPERM;
+		if (copy_from_user(&irq_thread, (void __user *)arg,
+				   sizeof(irq_thread)))
+			return -EFAULT;
+		return cmidid_gpio_set_irq_thread(&inst->gpio, &irq_thread);
+	case CMIDID_REMAP:
+		/* Claims and releases GPIOs and IRQs. */
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&remap, (void __user *)arg, sizeof(remap)))
+			return -EFAULT;
+		if (remap.num_keys == 0 || remap.num_keys > CMIDID_MAX_KEYS)
+			return -EINVAL;
+		mapping = memdup_user((void __user *)(uintptr_t)remap.keys,
+				      remap.num_keys * sizeof(*mapping));
+		if (IS_ERR(mapping))
+			return PTR_ERR(mapping);
+		err = cmidid_gpio_remap(&inst->gpio, mapping, remap.num_keys,
+					remap.flags, 0);
+		kfree(mapping);
+		return err;
+	case CMIDID_LOAD_KEYMAP:
+		/* Claims and releases GPIOs and IRQs like CMIDID_REMAP. */
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&keymap, (void __user *)arg, sizeof(keymap)))
+			return -EFAULT;
+		keymap.name[sizeof(keymap.name) - 1] = '\0';
+		return cmidid_gpio_load_keymap(&inst->gpio, keymap.name);
+	case CMIDID_INJECT:
+		if (copy_from_user(&inject, (void __user *)arg, sizeof(inject)))
+			return -EFAULT;
+		if ((err = cmidid_gpio_inject(&inst->gpio, &inject)) < 0)
+			return err;
+		if (copy_to_user((void __user *)arg, &inject, sizeof(inject)))
+			return -EFAULT;
 		break;
 	default:
 		dbg("unknown ioctl command\n");
@@ -5,4 +5,10 @@
 
 #define IOCTL_DEV_NAME MODULE_NAME
 
+/*
+ * Maximum number of keyboard instances. Each instance has its own key
+ * table, configuration, sequencer client and /dev/cmidid<N> node.
+ */
+#define CMIDID_MAX_INSTANCES 8
+
 #endif
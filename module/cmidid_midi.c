@@ -1,131 +1,180 @@
 #include <linux/slab.h>
 #include <linux/moduleparam.h>
-#include <linux/hardirq.h>	// for in_atomic()
 
 #include <sound/core.h>
 #include <sound/seq_kernel.h>
 
+#include "cmidid_main.h"
 #include "cmidid_midi.h"
+#include "cmidid_config.h"
+#include "cmidid_stats.h"
+#include "cmidid_trace.h"
 #include "cmidid_util.h"
 
 /*
- * The midi channel which is used for the generated notes.
+ * The midi channel which is used for the generated notes, one per instance.
+ * Instances without a value use channel 0.
  */
-static char midi_channel = 0x00;
-module_param(midi_channel, byte, 0);
-MODULE_PARM_DESC(midi_channel, "Which midi channel to use (0 - 15).");
+static char midi_channel[CMIDID_MAX_INSTANCES];
+static int midi_channel_size;
+module_param_array(midi_channel, byte, &midi_channel_size, 0);
+MODULE_PARM_DESC(midi_channel,
+		 "Which midi channel to use (0 - 15), one per instance.");
 
-/*
- * cmidid_midi_state:
- *
- * The state of the MIDI component of our kernel module.
- * @card: The sound card registered to the system.
- * @client: The client number used in the alsa sequencer system.
- * @midi_channel: the midi_channel used for the generated notes
- * @transpose: the transpose value in semitones added to the tone pitch.
- */
-struct cmidid_midi_state {
-	struct snd_card *card;
-	int client;
-	char midi_channel;
-	signed char transpose;
-};
-
-static struct cmidid_midi_state state = {
-	.card = NULL,
-	.client = 0,
-	.midi_channel = 0x00,
-	.transpose = 0
-};
-
-static void config_note_event(struct snd_seq_event *event, unsigned char note,
-			      unsigned char velocity,
+static void config_note_event(struct cmidid_midi_state *state,
+			      struct snd_seq_event *event, int channel,
+			      unsigned char pitch, unsigned char velocity,
 			      snd_seq_event_type_t type);
-static void dispatch_event(struct snd_seq_event *event);
+static void dispatch_event(struct cmidid_midi_state *state,
+			   struct snd_seq_event *event);
+
+static void modify_transpose(struct cmidid_config *cfg, long transpose)
+{
+	cfg->transpose = clamp_t(long, cfg->transpose + transpose, -127, 127);
+}
 
 /*
  * cmidid_transpose: Add a value to the current transpose.
  *
+ * @config: the configuration of the instance
  * @transpose: the value in semitones added to the current transpose
+ * @result: set to the new absolute transpose value in semitones (between
+ * -127 and 127)
  *
- * return: the new absolute transpose value in semitones (between -128 and 127)
+ * return: 0 on success or a negative error code.
  */
-signed char cmidid_transpose(signed char transpose)
+int cmidid_transpose(struct cmidid_config_state *config,
+		     signed char transpose, int *result)
 {
-	state.transpose += transpose;
+	struct cmidid_config cfg;
+	int err;
+
+	if ((err = cmidid_config_modify(config, modify_transpose, transpose,
+					&cfg)) < 0)
+		return err;
+
+	dbg("transpose by: %d, new transpose: %d\n", transpose, cfg.transpose);
 
-	dbg("transpose by: %d, new transpose: %d\n", transpose,
-	    state.transpose);
+	*result = cfg.transpose;
+	return 0;
+}
 
-	return state.transpose;
+/*
+ * note_index: Returns the index of a note in `sounding' and `pitch'.
+ *
+ * @state: the MIDI component of the instance
+ * @channel: the MIDI channel; negative for the `midi_channel' parameter
+ * @note: the (untransposed) note
+ */
+static inline unsigned int note_index(struct cmidid_midi_state *state,
+				      int channel, unsigned char note)
+{
+	return (channel < 0 ? state->midi_channel : channel) * 128 + note;
 }
 
 /*
-* cmidid_note_on: Trigger a note_on event.
+* cmidid_note_on: Trigger a note_on event. If the note already sounds,
+* e.g. because two keys share it, it is turned off first, so every note_on
+* has exactly one note_off.
 *
+* @state: the MIDI component of the instance
+* @cfg: the configuration snapshot of the current event
+* @channel: the MIDI channel; negative for the `midi_channel' parameter
 * @note: the pitch of the note (between 0 and 127)
 * @velocity: the velocity of the note
 */
-void cmidid_note_on(unsigned char note, unsigned char velocity)
+void cmidid_note_on(struct cmidid_midi_state *state,
+		    const struct cmidid_config *cfg, int channel,
+		    unsigned char note, unsigned char velocity)
 {
 	struct snd_seq_event event;
+	unsigned int i = note_index(state, channel, note);
 
 	dbg("noteon note: %d, vel: %d\n", note, velocity);
 
-	config_note_event(&event, note, velocity, SNDRV_SEQ_EVENT_NOTEON);
-	dispatch_event(&event);
+	spin_lock(&state->lock);
+
+	if (test_bit(i, state->sounding)) {
+		config_note_event(state, &event, channel, state->pitch[i], 127,
+				  SNDRV_SEQ_EVENT_NOTEOFF);
+		dispatch_event(state, &event);
+	}
+
+	state->pitch[i] = cmidid_transpose_note(cfg, note);
+	__set_bit(i, state->sounding);
+
+	config_note_event(state, &event, channel, state->pitch[i], velocity,
+			  SNDRV_SEQ_EVENT_NOTEON);
+	dispatch_event(state, &event);
+
+	spin_unlock(&state->lock);
 }
 
 /*
  * cmidid_note_off: Trigger a note_off event. For every note_on a
- * note_off should be triggered.
+ * note_off should be triggered. The note_off is sent with the pitch of the
+ * note_on, even if the transpose value changed in between. Note_offs for
+ * notes which do not sound are dropped.
  *
+ * @state: the MIDI component of the instance
+ * @cfg: the configuration snapshot of the current event
+ * @channel: the MIDI channel; negative for the `midi_channel' parameter
  * @note: the pitch of the note to turn off
  */
-void cmidid_note_off(unsigned char note)
+void cmidid_note_off(struct cmidid_midi_state *state,
+		     const struct cmidid_config *cfg, int channel,
+		     unsigned char note)
 {
 	struct snd_seq_event event;
+	unsigned int i = note_index(state, channel, note);
 
 	dbg("noteoff note: %d\n", note);
 
-	config_note_event(&event, note, 127, SNDRV_SEQ_EVENT_NOTEOFF);
-	dispatch_event(&event);
+	spin_lock(&state->lock);
+
+	if (!__test_and_clear_bit(i, state->sounding)) {
+		spin_unlock(&state->lock);
+		cmidid_stats_count(CMIDID_COUNT_NOTE_OFF_SUPPRESSED);
+		return;
+	}
+
+	config_note_event(state, &event, channel, state->pitch[i], 127,
+			  SNDRV_SEQ_EVENT_NOTEOFF);
+	dispatch_event(state, &event);
+
+	spin_unlock(&state->lock);
 }
 
 /*
  * config_note_event: Configure a alsa sequencer event as note.
- * The 
  *
+ * @state: the MIDI component of the instance
  * @event: a pointer to the event which will be configured
- * @note: the note which sould be set. Forced bounds between 0 and 127
+ * @channel: the MIDI channel; negative for the `midi_channel' parameter
+ * @pitch: the transposed note, see cmidid_transpose_note
  * @velocity: Velocity of the note. Forced bounds between 0 and 127
  * @type: note on or note off event
  */
-static void config_note_event(struct snd_seq_event *event, unsigned char note,
-			      unsigned char velocity, snd_seq_event_type_t type)
+static void config_note_event(struct cmidid_midi_state *state,
+			      struct snd_seq_event *event, int channel,
+			      unsigned char pitch, unsigned char velocity,
+			      snd_seq_event_type_t type)
 {
-	//take transpose into account
-	note += state.transpose;
-
-	//cap the pitch of the note at 127
-	if (note >= 127)
-		note = 127;
-
 	//cap the velocity of the note at 127
 	if (velocity >= 127)
 		velocity = 127;
 
 	event->type = type;
 	event->flags = SNDRV_SEQ_EVENT_LENGTH_FIXED | SNDRV_SEQ_PRIORITY_NORMAL;
-	event->data.note.note = note;
-	event->data.note.channel = state.midi_channel;
+	event->data.note.note = pitch;
+	event->data.note.channel = channel < 0 ? state->midi_channel : channel;
 	event->data.note.velocity = velocity;
 	event->data.note.duration = 0xffffff;
 	event->data.note.off_velocity = velocity;
 	event->queue = SNDRV_SEQ_QUEUE_DIRECT;
 	event->dest.client = SNDRV_SEQ_ADDRESS_SUBSCRIBERS;
 	event->dest.port = 0;	/* FIXME: Which ports to use ? */
-	event->source.client = state.client;
+	event->source.client = state->client;
 	event->source.port = 0;
 }
 
@@ -133,71 +182,93 @@ static void config_note_event(struct snd_seq_event *event, unsigned char note,
  * dispatch_event: dispatch an alsa event to the alsa
  * sequencer client registered by this module
  *
+ * @state: the MIDI component of the instance
  * @event: the event to dispatch
  */
-static void dispatch_event(struct snd_seq_event *event)
+static void dispatch_event(struct cmidid_midi_state *state,
+			   struct snd_seq_event *event)
 {
 	int err;
 
-	if (state.client > 0) {
+	if (state->client > 0) {
 		err =
-		    snd_seq_kernel_client_dispatch(state.client, event,
-						   in_atomic(), 0);
+		    snd_seq_kernel_client_dispatch(state->client, event,
+						   1, 0);
+		trace_cmidid_note_dispatch(state->client, event->type,
+					   event->data.note.channel,
+					   event->data.note.note,
+					   event->data.note.velocity, err);
 		if (err < 0) {
+			cmidid_stats_count(CMIDID_COUNT_DISPATCH_FAIL);
 			warn("couldn't dispatch note(%d) code:%d\n",
-			     state.client, err);
+			     state->client, err);
+		} else {
+			cmidid_stats_record_since_mark
+			    (CMIDID_STAGE_THREAD_TO_DISPATCH);
 		}
 	}
 }
 
 /*
  * cmidid_midi_init: Initialize MIDI component.
- * 
+ *
+ * @state: the MIDI component of the instance
+ * @index: the number of the instance; selects the `midi_channel' value and
+ * names the sequencer client
+ *
  * return: zero on success and negative error code
  * on error
  */
-int cmidid_midi_init(void)
+int cmidid_midi_init(struct cmidid_midi_state *state, int index)
 {
 	int err;
 	struct snd_seq_port_info pinfo;
 
+	spin_lock_init(&state->lock);
+	bitmap_zero(state->sounding, CMIDID_MIDI_NOTES);
+
+	//copy midi_channel of this instance to state struct
+	state->midi_channel = index < midi_channel_size ? midi_channel[index] : 0;
+
 	//check if the midi_channel set module param is in valid range (0 - 15)
-	if (midi_channel < 0x00 || midi_channel > 0x0F) {
+	if (state->midi_channel < 0x00 || state->midi_channel > 0x0F) {
 		err("Midi channel must be between 0 and 15\n");
 		err = -EINVAL;
 		return err;
 	}
-	//copy midi_channel to state struct
-	state.midi_channel = midi_channel;
 
 	// register sound card at the alsa system
 	err =
 	    snd_card_create(-1, NULL, THIS_MODULE, sizeof(struct snd_card),
-			    &state.card);
+			    &state->card);
 	if (err < 0) {
 		err("error creating card: %d\n", err);
 		return err;
 	}
 	// add sequencer client to our sound card
-	state.client = snd_seq_create_kernel_client(state.card, 0, "cmidid");
-	if (state.client < 0) {
+	state->client =
+	    snd_seq_create_kernel_client(state->card, 0, MODULE_NAME "%d",
+					 index);
+	if (state->client < 0) {
+		err = state->client;
 		err("error creating client: %d\n", err);
-		snd_card_free(state.card);
+		snd_card_free(state->card);
 		return err;
 	}
 	// configure our sequencer client to have one readable (output) port
 	memset(&pinfo, 0, sizeof(struct snd_seq_port_info));
-	pinfo.addr.client = state.client;
+	pinfo.addr.client = state->client;
 	pinfo.capability |=
 	    SNDRV_SEQ_PORT_CAP_READ | SNDRV_SEQ_PORT_CAP_SYNC_READ |
 	    SNDRV_SEQ_PORT_CAP_SUBS_READ;
 
 	err =
-	    snd_seq_kernel_client_ctl(state.client, SNDRV_SEQ_IOCTL_CREATE_PORT,
+	    snd_seq_kernel_client_ctl(state->client, SNDRV_SEQ_IOCTL_CREATE_PORT,
 				      &pinfo);
 	if (err < 0) {
 		err("error creating port: %d\n", err);
-		snd_card_free(state.card);
+		snd_seq_delete_kernel_client(state->client);
+		snd_card_free(state->card);
 		return err;
 	}
 
@@ -206,12 +277,14 @@ int cmidid_midi_init(void)
 
 /*
  * cmidid_midi_exit: Cleanup MIDI component.
+ *
+ * @state: the MIDI component of the instance
  */
-void cmidid_midi_exit(void)
+void cmidid_midi_exit(struct cmidid_midi_state *state)
 {
 	// free our sequencer client
-	snd_seq_delete_kernel_client(state.client);
+	snd_seq_delete_kernel_client(state->client);
 
 	// free our sound card
-	snd_card_free(state.card);
+	snd_card_free(state->card);
 }
@@ -1,12 +1,70 @@
 #ifndef CMIDID_MIDI_H
 #define CMIDID_MIDI_H
 
-signed char cmidid_transpose(signed char transpose);
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/kernel.h>
 
-void cmidid_note_on(unsigned char note, unsigned char velocity);
-void cmidid_note_off(unsigned char note);
+#include "cmidid_ioctl.h"
 
-int cmidid_midi_init(void);
-void cmidid_midi_exit(void);
+/* Number of (channel, note) pairs a key can send. */
+#define CMIDID_MIDI_NOTES (16 * 128)
+
+struct cmidid_config_state;
+struct snd_card;
+
+/*
+ * cmidid_midi_state:
+ *
+ * The MIDI component of one instance: its own sound card with a sequencer
+ * client and one output port.
+ * @card: The sound card registered to the system.
+ * @client: The client number used in the alsa sequencer system.
+ * @midi_channel: the midi_channel used for the generated notes
+ * @lock: protects `sounding' and `pitch' and keeps the events of a note in
+ * order
+ * @sounding: bit `channel * 128 + note' is set while the (untransposed)
+ * note sounds on the channel
+ * @pitch: the transposed pitch the note_on of every sounding note was sent
+ * with
+ *
+ * The transpose value is part of the runtime configuration, see
+ * cmidid_config.c.
+ */
+struct cmidid_midi_state {
+	struct snd_card *card;
+	int client;
+	char midi_channel;
+	spinlock_t lock;
+	DECLARE_BITMAP(sounding, CMIDID_MIDI_NOTES);
+	unsigned char pitch[CMIDID_MIDI_NOTES];
+};
+
+/*
+ * cmidid_transpose_note: Returns the pitch a note is sent with.
+ *
+ * @cfg: the configuration snapshot holding the transpose value
+ * @note: the note (between 0 and 127)
+ *
+ * Return: the transposed note; clamped to 0 to 127
+ */
+static inline unsigned char cmidid_transpose_note(const struct cmidid_config
+						  *cfg, unsigned char note)
+{
+	return clamp_t(int, note + cfg->transpose, 0, 127);
+}
+
+int cmidid_transpose(struct cmidid_config_state *config,
+		     signed char transpose, int *result);
+
+void cmidid_note_on(struct cmidid_midi_state *state,
+		    const struct cmidid_config *cfg, int channel,
+		    unsigned char note, unsigned char velocity);
+void cmidid_note_off(struct cmidid_midi_state *state,
+		     const struct cmidid_config *cfg, int channel,
+		     unsigned char note);
+
+int cmidid_midi_init(struct cmidid_midi_state *state, int index);
+void cmidid_midi_exit(struct cmidid_midi_state *state);
 
 #endif
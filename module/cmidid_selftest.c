@@ -0,0 +1,368 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#include "cmidid_main.h"
+#include "cmidid_util.h"
+#include "cmidid_ioctl.h"
+#include "cmidid_config.h"
+#include "cmidid_keyfsm.h"
+#include "cmidid_velocity.h"
+#include "cmidid_midi.h"
+#include "cmidid_stats.h"
+#include "cmidid_selftest.h"
+
+/* Number of samples of every velocity curve checked per configuration. */
+#define SELFTEST_VELOCITY_SAMPLES 100000
+
+/* Number of random button events fed into the key state machine. */
+#define SELFTEST_FSM_EVENTS 100000
+
+/* Number of calls timed by every benchmark. */
+#define SELFTEST_BENCH_CALLS 100000
+
+static const char *const curve_names[] = {
+	[VEL_CURVE_LINEAR] = "linear",
+	[VEL_CURVE_CONCAVE] = "concave",
+	[VEL_CURVE_CONVEX] = "convex",
+	[VEL_CURVE_SATURATED] = "saturated",
+};
+
+/* Stroke times (in 2^10 ns) the velocity curves are checked with. */
+static const struct {
+	u32 min, max;
+} stroke_times[] = {
+	{1000, 1000000},	/* the defaults of the module parameters */
+	{0, 1},
+	{1, 3},
+	{100, 4000000000U},
+};
+
+/*
+ * Known velocities with the default stroke times. 19531 and 4882 are the
+ * 20 ms and 5 ms strokes of example.strokes.
+ */
+static const struct {
+	u32 t;
+	unsigned char v[VEL_CURVE_SATURATED + 1];
+} velocity_points[] = {
+	/* linear, concave, convex, saturated */
+	{4882, {126, 127, 124, 127}},
+	{19531, {124, 126, 117, 127}},
+	{250000, {95, 109, 53, 127}},
+	{500000, {63, 85, 24, 127}},
+	{750000, {31, 51, 9, 117}},
+	{999999, {0, 1, 0, 1}},
+};
+
+static struct dentry *selftest_file;
+
+/* Keeps the compiler from dropping the benchmarked calls. */
+static volatile unsigned int sink;
+
+/*
+ * check_velocity: Checks a velocity curve over the whole stroke time range:
+ * the minimum time gives 127, the maximum 0, and the velocity never
+ * increases with the time.
+ *
+ * Return: 0 if the curve is valid; -1 otherwise.
+ */
+static int check_velocity(struct seq_file *m, unsigned int curve,
+			  const struct cmidid_config *cfg)
+{
+	u64 t, step = div_u64(cfg->stroke_time_max - cfg->stroke_time_min,
+			      SELFTEST_VELOCITY_SAMPLES) + 1;
+	unsigned char v, last = 127;
+
+	if (time_to_velocity(cfg->stroke_time_min, curve, cfg) != 127
+	    || time_to_velocity(cfg->stroke_time_max, curve, cfg) != 0)
+		goto fail;
+
+	for (t = cfg->stroke_time_min; t <= cfg->stroke_time_max; t += step) {
+		v = time_to_velocity(t, curve, cfg);
+		if (v > last)
+			goto fail;
+		last = v;
+	}
+
+	return 0;
+
+ fail:
+	seq_printf(m, "FAIL: %s curve with stroke times %u-%u\n",
+		   curve_names[curve], cfg->stroke_time_min,
+		   cfg->stroke_time_max);
+	return -1;
+}
+
+/*
+ * check_velocity_points: Checks the curves against known velocities, so a
+ * changed constant or rounding is noticed as well.
+ *
+ * Return: 0 if all velocities match; -1 otherwise.
+ */
+static int check_velocity_points(struct seq_file *m)
+{
+	struct cmidid_config cfg = {
+		.stroke_time_min = stroke_times[0].min,
+		.stroke_time_max = stroke_times[0].max,
+	};
+	unsigned int curve;
+	unsigned char v;
+	int i, failed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(velocity_points); i++)
+		for (curve = 0; curve < ARRAY_SIZE(curve_names); curve++) {
+			v = time_to_velocity(velocity_points[i].t, curve, &cfg);
+			if (v != velocity_points[i].v[curve]) {
+				seq_printf(m, "FAIL: %s curve at %u gave %u, "
+					   "expected %u\n", curve_names[curve],
+					   velocity_points[i].t, v,
+					   velocity_points[i].v[curve]);
+				failed = -1;
+			}
+		}
+
+	return failed;
+}
+
+/*
+ * check_fsm: Checks the transition table and feeds random button events
+ * into the state machine, counting the notes like a synthesizer would.
+ *
+ * Return: 0 if every note_on got exactly one note_off; -1 otherwise.
+ */
+static int check_fsm(struct seq_file *m)
+{
+	struct key_transition t;
+	unsigned int state = KEY_INACTIVE, r;
+	int i, err, sounds = 0;
+
+	if ((err = key_fsm_check()) != 0) {
+		seq_printf(m, "FAIL: key transition %d\n", err - 1);
+		return -1;
+	}
+
+	for (i = 0; i < SELFTEST_FSM_EVENTS; i++) {
+		r = prandom_u32();
+		t = key_transition(state, r & 1, r & 2);
+
+		if (t.actions & KEY_ACTION_NOTE_OFF)
+			sounds--;
+		if (t.actions & KEY_ACTION_NOTE_ON)
+			sounds++;
+		state = t.next;
+
+		if (sounds != key_sounds(state)) {
+			seq_printf(m, "FAIL: unpaired note after %d events\n",
+				   i + 1);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * check_transpose: Checks that transposed notes are clamped to 0 to 127
+ * for every note and transpose value.
+ *
+ * Return: 0 on success; -1 otherwise.
+ */
+static int check_transpose(struct seq_file *m)
+{
+	struct cmidid_config cfg;
+	int note;
+
+	for (cfg.transpose = -127; cfg.transpose <= 127; cfg.transpose++)
+		for (note = 0; note <= 127; note++)
+			if (cmidid_transpose_note(&cfg, note) !=
+			    clamp(note + cfg.transpose, 0, 127)) {
+				seq_printf(m, "FAIL: note %d transposed by %d\n",
+					   note, cfg.transpose);
+				return -1;
+			}
+
+	return 0;
+}
+
+/*
+ * bench_start/bench_end: Time a benchmark loop with preemption disabled.
+ */
+static ktime_t bench_start(void)
+{
+	preempt_disable();
+	return ktime_get();
+}
+
+static void bench_end(struct seq_file *m, const char *name, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	s32 rem;
+
+	preempt_enable();
+
+	/* Hundredths of a nanosecond per call. */
+	ns = div_s64_rem(div_s64(ns * 100, SELFTEST_BENCH_CALLS), 100, &rem);
+	seq_printf(m, "%-26s %6lld.%02d ns/call\n", name, ns, rem);
+}
+
+/*
+ * run_benchmarks: Times the functions called for every key event.
+ */
+static void run_benchmarks(struct seq_file *m)
+{
+	struct cmidid_config cfg = {
+		.stroke_time_min = stroke_times[0].min,
+		.stroke_time_max = stroke_times[0].max,
+		.transpose = 12,
+	};
+	char name[32];
+	unsigned int curve, acc = 0;
+	ktime_t start;
+	u32 t;
+	int i;
+
+	for (curve = 0; curve < ARRAY_SIZE(curve_names); curve++) {
+		snprintf(name, sizeof(name), "time_to_velocity(%s)",
+			 curve_names[curve]);
+		start = bench_start();
+		for (i = 0, t = cfg.stroke_time_min; i < SELFTEST_BENCH_CALLS;
+		     i++, t += 7)
+			acc += time_to_velocity(t, curve, &cfg);
+		bench_end(m, name, start);
+	}
+
+	start = bench_start();
+	for (i = 0; i < SELFTEST_BENCH_CALLS; i++)
+		acc += key_transition(acc % KEY_NR_STATES, i & 1, i & 2).next;
+	bench_end(m, "key_transition", start);
+
+	start = bench_start();
+	for (i = 0; i < SELFTEST_BENCH_CALLS; i++)
+		acc += cmidid_transpose_note(&cfg, i & 127);
+	bench_end(m, "cmidid_transpose_note", start);
+
+	sink = acc;
+}
+
+/*
+ * check_transpose_steps: Transposes a scratch configuration up and down
+ * and checks the new values, including negative ones and the clamping at
+ * both ends.
+ *
+ * Return: 0 on success; -1 otherwise.
+ */
+static int check_transpose_steps(struct seq_file *m)
+{
+	static const struct {
+		signed char step;
+		int expected;
+	} steps[] = {
+		{-12, -12},
+		{5, -7},
+		{-127, -127},
+		{127, 0},
+		{100, 100},
+		{100, 127},
+		{-1, 126},
+	};
+	struct cmidid_config_state config;
+	struct cmidid_config cfg = {
+		.version = CMIDID_CONFIG_VERSION,
+		.stroke_time_min = stroke_times[0].min,
+		.stroke_time_max = stroke_times[0].max,
+		.vel_curve = VEL_CURVE_LINEAR,
+		.transpose = 0,
+	};
+	int i, err, transpose = 0, failed = 0;
+
+	if ((err = cmidid_config_init(&config, &cfg)) < 0) {
+		seq_printf(m, "FAIL: config init %d\n", err);
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(steps); i++) {
+		err = cmidid_transpose(&config, steps[i].step, &transpose);
+		if (err < 0 || transpose != steps[i].expected) {
+			seq_printf(m, "FAIL: transpose by %d gave %d (%d), "
+				   "expected %d\n", steps[i].step, transpose,
+				   err, steps[i].expected);
+			failed = -1;
+			break;
+		}
+	}
+
+	cmidid_config_exit(&config);
+	return failed;
+}
+
+/*
+ * selftest_show: Runs the checks and benchmarks.
+ */
+static int selftest_show(struct seq_file *m, void *v)
+{
+	struct cmidid_config cfg;
+	unsigned int curve;
+	int i, failed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(stroke_times); i++) {
+		cfg.stroke_time_min = stroke_times[i].min;
+		cfg.stroke_time_max = stroke_times[i].max;
+		for (curve = 0; curve < ARRAY_SIZE(curve_names); curve++) {
+			failed |= check_velocity(m, curve, &cfg);
+			cond_resched();
+		}
+	}
+	failed |= check_velocity_points(m);
+	failed |= check_fsm(m);
+	failed |= check_transpose(m);
+	failed |= check_transpose_steps(m);
+
+	seq_printf(m, "selftest: %s\n\n", failed ? "FAIL" : "ok");
+
+	run_benchmarks(m);
+
+	return 0;
+}
+
+static int selftest_open(struct inode *inode, struct file *f)
+{
+	return single_open(f, selftest_show, NULL);
+}
+
+static const struct file_operations selftest_fops = {
+	.owner = THIS_MODULE,
+	.open = selftest_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * cmidid_selftest_init: Creates /sys/kernel/debug/cmidid/selftest. Must be
+ * called after cmidid_stats_init. Without debugfs there is no selftest.
+ *
+ * Return: 0
+ */
+int cmidid_selftest_init(void)
+{
+	if (cmidid_stats_debugfs_dir() != NULL)
+		selftest_file = debugfs_create_file("selftest", S_IRUSR,
+						    cmidid_stats_debugfs_dir(),
+						    NULL, &selftest_fops);
+	return 0;
+}
+
+/*
+ * cmidid_selftest_exit: Removes the selftest file.
+ */
+void cmidid_selftest_exit(void)
+{
+	debugfs_remove(selftest_file);
+	selftest_file = NULL;
+}
@@ -0,0 +1,7 @@
+#ifndef CMIDID_SELFTEST_H
+#define CMIDID_SELFTEST_H
+
+int cmidid_selftest_init(void);
+void cmidid_selftest_exit(void);
+
+#endif
@@ -0,0 +1,273 @@
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+#include "cmidid_main.h"
+#include "cmidid_util.h"
+#include "cmidid_stats.h"
+
+/* Number of log2 buckets; the last one collects everything >= 2^31 ns. */
+#define CMIDID_STATS_BUCKETS 32
+
+/*
+ * cmidid_stats_cpu:
+ *
+ * The statistics of one CPU. Every CPU only writes its own copy, so
+ * recording needs neither locks nor atomic operations.
+ *
+ * @hist: bucket i counts intervals in [2^i, 2^(i+1)) ns; bucket 0 also
+ * counts zero
+ * @counters: the event counters
+ * @mark: start of the stage opened by cmidid_stats_mark; zero while no
+ * stage is open
+ */
+struct cmidid_stats_cpu {
+	u32 hist[CMIDID_NR_STAGES][CMIDID_STATS_BUCKETS];
+	u64 counters[CMIDID_NR_COUNTERS];
+	ktime_t mark;
+};
+
+static DEFINE_PER_CPU(struct cmidid_stats_cpu, stats_cpu);
+
+struct static_key cmidid_stats_key = STATIC_KEY_INIT_FALSE;
+
+static const char *const stage_names[CMIDID_NR_STAGES] = {
+	[CMIDID_STAGE_IRQ_TO_THREAD] = "irq_to_thread",
+	[CMIDID_STAGE_DEBOUNCE_LATE] = "debounce_late",
+	[CMIDID_STAGE_THREAD_TO_DISPATCH] = "thread_to_dispatch",
+};
+
+static const char *const counter_names[CMIDID_NR_COUNTERS] = {
+	[CMIDID_COUNT_BOUNCE] = "bounce_ignored",
+	[CMIDID_COUNT_DISPATCH_FAIL] = "dispatch_failed",
+	[CMIDID_COUNT_NOTE_OFF_SUPPRESSED] = "note_off_suppressed",
+};
+
+/*
+ * cmidid_stats_state:
+ *
+ * @dir: the debugfs directory of the module
+ * @enabled: the current state of `cmidid_stats_key'
+ * @lock: serializes enabling/disabling
+ */
+struct cmidid_stats_state {
+	struct dentry *dir;
+	bool enabled;
+	struct mutex lock;
+};
+
+static struct cmidid_stats_state state;
+
+void __cmidid_stats_record(enum cmidid_stats_stage stage, s64 ns)
+{
+	unsigned int bucket = 0;
+
+	if (ns > 1)
+		bucket = min_t(unsigned int, ilog2((u64)ns),
+			       CMIDID_STATS_BUCKETS - 1);
+
+	this_cpu_inc(stats_cpu.hist[stage][bucket]);
+}
+
+void __cmidid_stats_count(enum cmidid_stats_counter counter)
+{
+	this_cpu_inc(stats_cpu.counters[counter]);
+}
+
+void __cmidid_stats_mark(void)
+{
+	__this_cpu_write(stats_cpu.mark, ktime_get());
+}
+
+void __cmidid_stats_clear_mark(void)
+{
+	__this_cpu_write(stats_cpu.mark, ktime_set(0, 0));
+}
+
+void __cmidid_stats_record_since_mark(enum cmidid_stats_stage stage)
+{
+	ktime_t mark = __this_cpu_read(stats_cpu.mark);
+
+	if (mark.tv64 == 0)
+		return;
+
+	__cmidid_stats_clear_mark();
+	__cmidid_stats_record(stage, ktime_to_ns(ktime_sub(ktime_get(), mark)));
+}
+
+/*
+ * stats_reset: Clears the statistics of all CPUs.
+ */
+static void stats_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	    memset(per_cpu_ptr(&stats_cpu, cpu), 0,
+		   sizeof(struct cmidid_stats_cpu));
+}
+
+/*
+ * stats_show: Prints the histograms (summed over all CPUs) and counters.
+ */
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct cmidid_stats_cpu *c;
+	u64 sum;
+	int stage, bucket, counter, cpu;
+
+	seq_printf(m, "enabled: %d\n", state.enabled);
+
+	for (counter = 0; counter < CMIDID_NR_COUNTERS; counter++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+		    sum += per_cpu_ptr(&stats_cpu, cpu)->counters[counter];
+		seq_printf(m, "%s: %llu\n", counter_names[counter], sum);
+	}
+
+	for (stage = 0; stage < CMIDID_NR_STAGES; stage++) {
+		seq_printf(m, "\n%s (ns):\n", stage_names[stage]);
+		for (bucket = 0; bucket < CMIDID_STATS_BUCKETS; bucket++) {
+			sum = 0;
+			for_each_possible_cpu(cpu) {
+				c = per_cpu_ptr(&stats_cpu, cpu);
+				sum += c->hist[stage][bucket];
+			}
+			if (sum == 0)
+				continue;
+			seq_printf(m, "%12llu - %12llu: %llu\n",
+				   bucket ? 1ULL << bucket : 0,
+				   (2ULL << bucket) - 1, sum);
+		}
+	}
+
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *f)
+{
+	return single_open(f, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * enable_write: Enables recording on "1" and disables it on "0".
+ */
+static ssize_t enable_write(struct file *f, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	char val[8];
+	bool enable;
+	size_t len = min(count, sizeof(val) - 1);
+
+	if (copy_from_user(val, buf, len))
+		return -EFAULT;
+	val[len] = '\0';
+
+	if (strtobool(val, &enable) < 0)
+		return -EINVAL;
+
+	mutex_lock(&state.lock);
+	if (enable && !state.enabled)
+		static_key_slow_inc(&cmidid_stats_key);
+	else if (!enable && state.enabled)
+		static_key_slow_dec(&cmidid_stats_key);
+	state.enabled = enable;
+	mutex_unlock(&state.lock);
+
+	return count;
+}
+
+static ssize_t enable_read(struct file *f, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	char val[2] = { state.enabled ? '1' : '0', '\n' };
+
+	return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+static const struct file_operations enable_fops = {
+	.owner = THIS_MODULE,
+	.read = enable_read,
+	.write = enable_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * reset_write: Any write clears all statistics.
+ */
+static ssize_t reset_write(struct file *f, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	stats_reset();
+	return count;
+}
+
+static const struct file_operations reset_fops = {
+	.owner = THIS_MODULE,
+	.write = reset_write,
+	.llseek = noop_llseek,
+};
+
+/*
+ * cmidid_stats_debugfs_dir: Returns the debugfs directory of the module, so
+ * other components can add their files to it.
+ *
+ * Return: The directory or NULL if debugfs is not available.
+ */
+struct dentry *cmidid_stats_debugfs_dir(void)
+{
+	return state.dir;
+}
+
+/*
+ * cmidid_stats_init: Creates the debugfs interface:
+ * /sys/kernel/debug/cmidid/{enable,stats,reset}
+ * A missing debugfs is not an error, the statistics are not available then.
+ *
+ * Return: 0
+ */
+int cmidid_stats_init(void)
+{
+	mutex_init(&state.lock);
+
+	state.dir = debugfs_create_dir(MODULE_NAME, NULL);
+	if (IS_ERR_OR_NULL(state.dir)) {
+		warn("debugfs not available, no statistics\n");
+		state.dir = NULL;
+		return 0;
+	}
+
+	debugfs_create_file("enable", S_IRUSR | S_IWUSR, state.dir, NULL,
+			    &enable_fops);
+	debugfs_create_file("stats", S_IRUSR, state.dir, NULL, &stats_fops);
+	debugfs_create_file("reset", S_IWUSR, state.dir, NULL, &reset_fops);
+
+	return 0;
+}
+
+/*
+ * cmidid_stats_exit: Removes the debugfs interface and disables recording.
+ */
+void cmidid_stats_exit(void)
+{
+	debugfs_remove_recursive(state.dir);
+
+	mutex_lock(&state.lock);
+	if (state.enabled)
+		static_key_slow_dec(&cmidid_stats_key);
+	state.enabled = false;
+	mutex_unlock(&state.lock);
+}
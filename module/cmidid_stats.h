@@ -0,0 +1,109 @@
+#ifndef CMIDID_STATS_H
+#define CMIDID_STATS_H
+
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+
+/*
+ * The intervals of the key event pipeline which are recorded in log2
+ * histograms (in ns).
+ *
+ * @CMIDID_STAGE_IRQ_TO_THREAD: GPIO interrupt to the start of `irq_thread'
+ * @CMIDID_STAGE_DEBOUNCE_LATE: how late `irq_thread' wakes up after
+ * `jitter_res_time'
+ * @CMIDID_STAGE_THREAD_TO_DISPATCH: the read of the GPIO value in
+ * `irq_thread' to the completion of `snd_seq_kernel_client_dispatch'
+ */
+enum cmidid_stats_stage {
+	CMIDID_STAGE_IRQ_TO_THREAD,
+	CMIDID_STAGE_DEBOUNCE_LATE,
+	CMIDID_STAGE_THREAD_TO_DISPATCH,
+	CMIDID_NR_STAGES
+};
+
+/*
+ * Event counters.
+ *
+ * @CMIDID_COUNT_BOUNCE: GPIO interrupts ignored during `jitter_res_time'
+ * @CMIDID_COUNT_DISPATCH_FAIL: failed calls of
+ * `snd_seq_kernel_client_dispatch'
+ * @CMIDID_COUNT_NOTE_OFF_SUPPRESSED: note_offs dropped because the note did
+ * not sound
+ */
+enum cmidid_stats_counter {
+	CMIDID_COUNT_BOUNCE,
+	CMIDID_COUNT_DISPATCH_FAIL,
+	CMIDID_COUNT_NOTE_OFF_SUPPRESSED,
+	CMIDID_NR_COUNTERS
+};
+
+extern struct static_key cmidid_stats_key;
+
+/*
+ * cmidid_stats_enabled: Returns true if statistics are recorded. This is a
+ * static key, so the check is a single no-op instruction while disabled.
+ * Callers should take timestamps only if this returns true.
+ */
+static inline bool cmidid_stats_enabled(void)
+{
+	return static_key_false(&cmidid_stats_key);
+}
+
+void __cmidid_stats_record(enum cmidid_stats_stage stage, s64 ns);
+void __cmidid_stats_count(enum cmidid_stats_counter counter);
+void __cmidid_stats_mark(void);
+void __cmidid_stats_clear_mark(void);
+void __cmidid_stats_record_since_mark(enum cmidid_stats_stage stage);
+
+static inline void cmidid_stats_record(enum cmidid_stats_stage stage, s64 ns)
+{
+	if (cmidid_stats_enabled())
+		__cmidid_stats_record(stage, ns);
+}
+
+static inline void cmidid_stats_count(enum cmidid_stats_counter counter)
+{
+	if (cmidid_stats_enabled())
+		__cmidid_stats_count(counter);
+}
+
+/*
+ * cmidid_stats_mark: Remember the current time on this CPU as start of a
+ * stage which ends in a different function. Must be called with preemption
+ * disabled, and the caller has to stay on this CPU until the matching
+ * cmidid_stats_record_since_mark or cmidid_stats_clear_mark.
+ */
+static inline void cmidid_stats_mark(void)
+{
+	if (cmidid_stats_enabled())
+		__cmidid_stats_mark();
+}
+
+/*
+ * cmidid_stats_clear_mark: Close the stage opened by cmidid_stats_mark if
+ * it was not recorded, so later calls outside of the stage record nothing.
+ */
+static inline void cmidid_stats_clear_mark(void)
+{
+	if (cmidid_stats_enabled())
+		__cmidid_stats_clear_mark();
+}
+
+/*
+ * cmidid_stats_record_since_mark: Record the time since cmidid_stats_mark
+ * and close the stage. Nothing is recorded if no stage is open, so only the
+ * first event of a stage is recorded.
+ */
+static inline void cmidid_stats_record_since_mark(enum cmidid_stats_stage
+						  stage)
+{
+	if (cmidid_stats_enabled())
+		__cmidid_stats_record_since_mark(stage);
+}
+
+struct dentry *cmidid_stats_debugfs_dir(void);
+
+int cmidid_stats_init(void);
+void cmidid_stats_exit(void);
+
+#endif
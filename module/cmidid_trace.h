@@ -0,0 +1,85 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cmidid
+
+#if !defined(_CMIDID_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CMIDID_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the key event pipeline. They can be enabled with
+ * ftrace or perf, e.g.:
+ *   echo 1 > /sys/kernel/debug/tracing/events/cmidid/enable
+ */
+
+TRACE_EVENT(cmidid_irq,
+	    TP_PROTO(unsigned int irq, unsigned int gpio, s64 timestamp,
+		     bool ignored),
+	    TP_ARGS(irq, gpio, timestamp, ignored),
+	    TP_STRUCT__entry(__field(unsigned int, irq)
+			     __field(unsigned int, gpio)
+			     __field(s64, timestamp)
+			     __field(bool, ignored)),
+	    TP_fast_assign(__entry->irq = irq;
+			   __entry->gpio = gpio;
+			   __entry->timestamp = timestamp;
+			   __entry->ignored = ignored;),
+	    TP_printk("irq=%u gpio=%u ts=%lld%s", __entry->irq,
+		      __entry->gpio, __entry->timestamp,
+		      __entry->ignored ? " ignored" : "")
+);
+
+TRACE_EVENT(cmidid_key_state,
+	    TP_PROTO(unsigned int key, unsigned char button, bool active,
+		     unsigned char old_state, unsigned char new_state,
+		     u32 stroke_time, s64 timestamp),
+	    TP_ARGS(key, button, active, old_state, new_state, stroke_time,
+		    timestamp),
+	    TP_STRUCT__entry(__field(unsigned int, key)
+			     __field(unsigned char, button)
+			     __field(bool, active)
+			     __field(unsigned char, old_state)
+			     __field(unsigned char, new_state)
+			     __field(u32, stroke_time)
+			     __field(s64, timestamp)),
+	    TP_fast_assign(__entry->key = key;
+			   __entry->button = button;
+			   __entry->active = active;
+			   __entry->old_state = old_state;
+			   __entry->new_state = new_state;
+			   __entry->stroke_time = stroke_time;
+			   __entry->timestamp = timestamp;),
+	    TP_printk("key=%u button=%u active=%d state=%u->%u stroke=%u ts=%lld",
+		      __entry->key, __entry->button, __entry->active,
+		      __entry->old_state, __entry->new_state,
+		      __entry->stroke_time, __entry->timestamp)
+);
+
+TRACE_EVENT(cmidid_note_dispatch,
+	    TP_PROTO(int client, unsigned char type, unsigned char channel,
+		     unsigned char note, unsigned char velocity, int result),
+	    TP_ARGS(client, type, channel, note, velocity, result),
+	    TP_STRUCT__entry(__field(int, client)
+			     __field(unsigned char, type)
+			     __field(unsigned char, channel)
+			     __field(unsigned char, note)
+			     __field(unsigned char, velocity)
+			     __field(int, result)),
+	    TP_fast_assign(__entry->client = client;
+			   __entry->type = type;
+			   __entry->channel = channel;
+			   __entry->note = note;
+			   __entry->velocity = velocity;
+			   __entry->result = result;),
+	    TP_printk("client=%d type=%u channel=%u note=%u velocity=%u result=%d",
+		      __entry->client, __entry->type, __entry->channel,
+		      __entry->note, __entry->velocity, __entry->result)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cmidid_trace
+#include <trace/define_trace.h>
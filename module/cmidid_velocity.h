@@ -0,0 +1,84 @@
+#ifndef CMIDID_VELOCITY_H
+#define CMIDID_VELOCITY_H
+
+/*
+ * The velocity curves. Like cmidid_keyfsm.h, this header only depends on
+ * cmidid_ioctl.h, so it can be used and checked outside the kernel as well.
+ */
+
+#include "cmidid_ioctl.h"
+
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#else
+static inline __s64 div64_s64(__s64 dividend, __s64 divisor)
+{
+	return dividend / divisor;
+}
+#endif
+
+/*
+ * hyperbola: Interpolates between 127 and 0 with the hyperbola
+ * v(u) = c + a / (u - b) through (0, 127) and (delta, 0). Solving for a and
+ * b and scaling by 127 gives v(u) = c + c (c - 127) delta / (127 u - c delta).
+ * For c > 127 the denominator is at most (127 - c) delta < 0, for c < 0 it
+ * is at least -c delta > 0, so it never comes close to zero.
+ *
+ * @u: time since the start of the curve; 0 to delta
+ * @delta: length of the curve; at least 1
+ * @c: the asymptote; above 127 for a concave, below 0 for a convex curve
+ */
+static inline __s64 hyperbola(__s64 u, __s64 delta, __s64 c)
+{
+	return c + div64_s64(c * (c - 127) * delta, 127 * u - c * delta);
+}
+
+/*
+ * time_to_velocity: Maps the measured time difference to a velocity.
+ * The curve determines which function is used the interpolate between the
+ * minimum and maximum stroke time.
+ *
+ * @t: time value in 2^10 nanoseconds
+ * @curve: the velocity curve; the one of the key or cfg->vel_curve
+ * @cfg: the configuration snapshot holding the stroke times; the minimum
+ * has to be below the maximum
+ *
+ * Return: The calculated velocity (0 to 127).
+ */
+static inline unsigned char time_to_velocity(__u32 t, unsigned int curve,
+					     const struct cmidid_config *cfg)
+{
+	__s64 u = (__s64)t - cfg->stroke_time_min;
+	__s64 delta = (__s64)cfg->stroke_time_max - cfg->stroke_time_min;
+	__s64 v;
+
+	if (t <= cfg->stroke_time_min)
+		return 127;
+	if (t >= cfg->stroke_time_max)
+		return 0;
+
+	switch (curve) {
+	case VEL_CURVE_LINEAR:
+		v = div64_s64(127 * (delta - u), delta);
+		break;
+	case VEL_CURVE_CONCAVE:
+		v = hyperbola(u, delta, 255);
+		break;
+	case VEL_CURVE_CONVEX:
+		v = hyperbola(u, delta, -40);
+		break;
+	case VEL_CURVE_SATURATED:
+		/* Full velocity for the first half of the range. */
+		if (u <= delta / 2)
+			return 127;
+		v = hyperbola(u - delta / 2, delta - delta / 2, 140);
+		break;
+	default:
+		return 0;
+	}
+
+	/* Rounding may leave the range at both ends. */
+	return v < 0 ? 0 : v > 127 ? 127 : v;
+}
+
+#endif
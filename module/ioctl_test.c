@@ -1,5 +1,9 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "cmidid_ioctl.h"
 #include <stdio.h>
@@ -13,21 +17,43 @@ void print_options()
 	       "[4] Set velocity curve to concave\n"
 	       "[5] Set velocity curve to convex\n"
 	       "[6] Set velocity curve to saturated\n"
-	       "[7] Transpose\nOption:");
+	       "[7] Transpose\n"
+	       "[8] Show configuration\n"
+	       "[9] Set configuration\n"
+	       "[10] Remap keys\n"
+	       "[11] Load keymap\nOption:");
+}
+
+void print_config(struct cmidid_config *cfg)
+{
+	printf("Configuration (generation %u):\n"
+	       "  velocity curve:  %u\n"
+	       "  stroke time min: %u\n"
+	       "  stroke time max: %u\n"
+	       "  transpose:       %d\n", cfg->generation, cfg->vel_curve,
+	       cfg->stroke_time_min, cfg->stroke_time_max, cfg->transpose);
 }
 
 int main(int argc, char *argv[])
 {
-	char *file_name = "/dev/cmidid";
+	char *file_name = "/dev/cmidid0";
 	int fd;
 	int value;
 	int err = 0;
 	uint32_t min_time;
+	struct cmidid_config cfg;
+	struct cmidid_remap remap;
+	struct cmidid_key_mapping *keys;
+	struct cmidid_keymap_name keymap;
+	unsigned int i;
+
+	if (argc > 1)
+		file_name = argv[1];
 
 	fd = open(file_name, 0);
 
 	if (fd == -1) {
-		perror("open /dev/cmidid failed\n");
+		perror("open failed");
 		return 2;
 	}
 	err = 1;
@@ -60,12 +86,85 @@ int main(int argc, char *argv[])
 			printf("Velocity curve set to saturated!\n");
 			break;
 		case 7:
-			printf("Current transpose is %ld add: ",
+			printf("Current transpose is %d add: ",
 			       ioctl(fd, CMIDID_TRANSPOSE, 0) - 128);
 			err = scanf("%d", &value);
-			printf("Transpose set to: %ld\n",
+			printf("Transpose set to: %d\n",
 			       ioctl(fd, CMIDID_TRANSPOSE, value) - 128);
 			break;
+		case 8:
+			if (ioctl(fd, CMIDID_GET_CONFIG, &cfg) < 0) {
+				perror("CMIDID_GET_CONFIG failed");
+				break;
+			}
+			print_config(&cfg);
+			break;
+		case 9:
+			cfg.version = CMIDID_CONFIG_VERSION;
+			printf("velocity curve, stroke time min, stroke time max, "
+			       "transpose: ");
+			err = scanf("%u %u %u %d", &cfg.vel_curve,
+				    &cfg.stroke_time_min, &cfg.stroke_time_max,
+				    &cfg.transpose);
+			if (err != 4) {
+				printf("Invalid input\n");
+				break;
+			}
+			err = 1;
+			if (ioctl(fd, CMIDID_SET_CONFIG, &cfg) < 0) {
+				perror("CMIDID_SET_CONFIG failed");
+				break;
+			}
+			printf("Configuration set!\n");
+			break;
+		case 10:
+			printf("number of keys, flags (1: start button active high, "
+			       "2: end button active high): ");
+			err = scanf("%u %u", &remap.num_keys, &remap.flags);
+			if (err != 2 || remap.num_keys == 0) {
+				printf("Invalid input\n");
+				err = 1;
+				break;
+			}
+			keys = calloc(remap.num_keys, sizeof(*keys));
+			if (keys == NULL) {
+				perror("calloc failed");
+				break;
+			}
+			printf("gpio1, gpio2, note of every key: ");
+			for (i = 0; i < remap.num_keys && err > 0; i++) {
+				err = scanf("%d %d %hhu", &keys[i].gpios[0],
+					    &keys[i].gpios[1], &keys[i].note);
+				keys[i].channel = CMIDID_KEY_DEFAULT;
+				keys[i].curve = CMIDID_KEY_DEFAULT;
+			}
+			if (err != 3) {
+				printf("Invalid input\n");
+				err = 1;
+				free(keys);
+				break;
+			}
+			err = 1;
+			remap.keys = (uintptr_t)keys;
+			if (ioctl(fd, CMIDID_REMAP, &remap) < 0)
+				perror("CMIDID_REMAP failed");
+			else
+				printf("Keys remapped!\n");
+			free(keys);
+			break;
+		case 11:
+			printf("keymap name: ");
+			err = scanf("%63s", keymap.name);
+			if (err != 1) {
+				printf("Invalid input\n");
+				err = 1;
+				break;
+			}
+			if (ioctl(fd, CMIDID_LOAD_KEYMAP, &keymap) < 0)
+				perror("CMIDID_LOAD_KEYMAP failed");
+			else
+				printf("Keymap loaded!\n");
+			break;
 		default:
 			printf("Unknown option");
 			break;
@@ -0,0 +1,391 @@
+/*
+ * replay_test: Replays a stroke file with simulated GPIO edges and reports
+ * how the module turned them into notes.
+ *
+ * The module has to be loaded with allow_inject=1 and a key table which
+ * contains the GPIOs of the stroke file. The edges are injected with
+ * CMIDID_INJECT at the given times, the resulting key events are read from
+ * the event ring.
+ *
+ * Stroke file format, one entry per line, `#' starts a comment:
+ *
+ *   key <key> <start gpio> <end gpio>   the GPIOs of a key of the key table
+ *   <time> <gpio> <level>               an edge; time in us from the start
+ *   expect <key> <velocity>             a note_on expected for the key
+ *
+ * Bounces are just additional edges. The expected notes of a key are
+ * matched in order.
+ *
+ * Usage: replay_test <stroke file> [device] [settle time in ms]
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "cmidid_ioctl.h"
+
+#define MAX_KEYS CMIDID_KEY_STATE_MAX_KEYS
+#define MAX_GPIOS 1024
+#define HIST_BUCKETS 32
+
+struct edge {
+	uint64_t time_us;
+	int gpio;
+	int level;
+	uint64_t timestamp;
+};
+
+struct expect {
+	int key;
+	int velocity;
+};
+
+static int key_gpios[MAX_KEYS][2];
+static struct edge *edges;
+static int num_edges;
+static struct expect *expects;
+static int num_expects;
+
+static void *grow(void *array, int num, size_t size)
+{
+	if (num % 64 == 0)
+		array = realloc(array, (num + 64) * size);
+	if (array == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	return array;
+}
+
+static int parse_stroke_file(const char *file_name)
+{
+	char line[256], *p;
+	int lineno = 0, key, a, b;
+	unsigned long long time_us;
+	FILE *f = fopen(file_name, "r");
+
+	if (f == NULL) {
+		perror("open stroke file failed");
+		return -1;
+	}
+
+	memset(key_gpios, -1, sizeof(key_gpios));
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		if (sscanf(line, " key %d %d %d", &key, &a, &b) == 3) {
+			if (key < 0 || key >= MAX_KEYS || a < 0 || a >= MAX_GPIOS
+			    || b < 0 || b >= MAX_GPIOS)
+				goto invalid;
+			key_gpios[key][0] = a;
+			key_gpios[key][1] = b;
+		} else if (sscanf(line, " expect %d %d", &key, &a) == 2) {
+			if (key < 0 || key >= MAX_KEYS || a < 1 || a > 127)
+				goto invalid;
+			expects = grow(expects, num_expects, sizeof(*expects));
+			expects[num_expects].key = key;
+			expects[num_expects].velocity = a;
+			num_expects++;
+		} else if (sscanf(line, " %llu %d %d", &time_us, &a, &b) == 3) {
+			if (a < 0 || a >= MAX_GPIOS || (b != 0 && b != 1)
+			    || (num_edges > 0
+				&& time_us < edges[num_edges - 1].time_us))
+				goto invalid;
+			edges = grow(edges, num_edges, sizeof(*edges));
+			edges[num_edges].time_us = time_us;
+			edges[num_edges].gpio = a;
+			edges[num_edges].level = b;
+			num_edges++;
+		} else if (strspn(line, " \t\r\n") != strlen(line)) {
+			goto invalid;
+		}
+	}
+
+	fclose(f);
+	return 0;
+
+ invalid:
+	fprintf(stderr, "%s:%d: invalid entry\n", file_name, lineno);
+	fclose(f);
+	return -1;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* Injects all edges at their time and records the kernel timestamps. */
+static int replay(int fd)
+{
+	struct cmidid_inject inject;
+	struct timespec start, t;
+	uint64_t ns;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ns = timespec_ns(&start) + 10000000;
+
+	for (i = 0; i < num_edges; i++) {
+		t.tv_sec = (ns + edges[i].time_us * 1000) / 1000000000;
+		t.tv_nsec = (ns + edges[i].time_us * 1000) % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+
+		inject.gpio = edges[i].gpio;
+		inject.level = edges[i].level;
+		if (ioctl(fd, CMIDID_INJECT, &inject) < 0) {
+			perror("CMIDID_INJECT failed");
+			return -1;
+		}
+		edges[i].timestamp = inject.timestamp;
+	}
+
+	return 0;
+}
+
+/* Lets the module read the GPIOs again. */
+static void release_gpios(int fd)
+{
+	struct cmidid_inject inject = {.level = -1 };
+	int i;
+
+	for (i = 0; i < num_edges; i++) {
+		inject.gpio = edges[i].gpio;
+		ioctl(fd, CMIDID_INJECT, &inject);
+	}
+}
+
+/*
+ * Copies the records from `seq' up to the head of the ring. Returns the
+ * number of records or -1 if the ring overflowed.
+ */
+static int read_ring(const char *ring, uint32_t seq, struct cmidid_event **out)
+{
+	const volatile struct cmidid_event_ring_header *hdr =
+	    (const void *)ring;
+	const volatile struct cmidid_event *rec;
+	struct cmidid_event *events;
+	uint32_t head = hdr->head;
+	int i, num = head - seq;
+
+	__sync_synchronize();
+
+	if ((uint32_t)num > hdr->num_records)
+		return -1;
+
+	events = calloc(num ? num : 1, sizeof(*events));
+	for (i = 0; i < num; i++, seq++) {
+		rec = (const void *)(ring + hdr->data_offset +
+				     (seq & (hdr->num_records - 1)) *
+				     hdr->record_size);
+		memcpy(&events[i], (const void *)rec, sizeof(*events));
+		__sync_synchronize();
+		if (events[i].seq != seq || rec->seq != seq) {
+			free(events);
+			return -1;
+		}
+	}
+
+	*out = events;
+	return num;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_velocities(struct cmidid_event *events, int num)
+{
+	int key, i, j, n, matched = 0, missed = 0, extra = 0, err;
+	int sum_err = 0, max_err = 0;
+
+	for (key = 0; key < MAX_KEYS; key++) {
+		i = j = 0;
+		for (;;) {
+			while (i < num_expects && expects[i].key != key)
+				i++;
+			while (j < num && (events[j].key != key
+					   || events[j].velocity == 0))
+				j++;
+			if (i == num_expects && j == num)
+				break;
+			if (i == num_expects) {
+				extra++;
+				j++;
+			} else if (j == num) {
+				missed++;
+				i++;
+			} else {
+				err = abs(events[j].velocity -
+					  expects[i].velocity);
+				sum_err += err;
+				if (err > max_err)
+					max_err = err;
+				matched++;
+				i++;
+				j++;
+			}
+		}
+	}
+
+	for (n = i = 0; i < num; i++)
+		if (events[i].velocity != 0)
+			n++;
+
+	printf("note_ons: %d, expected: %d\n", n, num_expects);
+	printf("matched: %d, missed: %d, extra: %d\n", matched, missed, extra);
+	if (matched)
+		printf("velocity error: mean %.2f, max %d\n",
+		       (double)sum_err / matched, max_err);
+}
+
+/* The time the module handled an event; `timestamp' is the edge time. */
+static uint64_t handled_time(const struct cmidid_event *ev)
+{
+	return ev->timestamp + ev->delay;
+}
+
+/*
+ * The latency of a key event is measured from the first edge of its button
+ * since the previous event of the button until it was handled, i.e. it
+ * includes the debouncing.
+ */
+static void report_latencies(struct cmidid_event *events, int num)
+{
+	static uint64_t pending[MAX_GPIOS];
+	uint64_t *lat = calloc(num ? num : 1, sizeof(*lat));
+	int hist[HIST_BUCKETS] = { 0 };
+	int i = 0, j = 0, n = 0, gpio, b;
+
+	while (j < num) {
+		if (i < num_edges && edges[i].timestamp <= handled_time(&events[j])) {
+			if (!pending[edges[i].gpio])
+				pending[edges[i].gpio] = edges[i].timestamp;
+			i++;
+			continue;
+		}
+
+		gpio = events[j].key < MAX_KEYS ?
+		    key_gpios[events[j].key][events[j].button] : -1;
+		if (gpio >= 0 && pending[gpio]) {
+			lat[n++] = handled_time(&events[j]) - pending[gpio];
+			pending[gpio] = 0;
+		}
+		j++;
+	}
+
+	printf("key events: %d, with edge: %d\n", num, n);
+	if (n == 0)
+		goto out;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("edge to event latency (ns): min %llu, p50 %llu, p90 %llu, "
+	       "p99 %llu, max %llu\n", (unsigned long long)lat[0],
+	       (unsigned long long)lat[n / 2],
+	       (unsigned long long)lat[n * 9 / 10],
+	       (unsigned long long)lat[n * 99 / 100],
+	       (unsigned long long)lat[n - 1]);
+
+	for (i = 0; i < n; i++) {
+		b = 63 - __builtin_clzll(lat[i] | 1);
+		hist[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+	}
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if (hist[b])
+			printf("%12llu - %12llu: %d\n",
+			       b ? 1ULL << b : 0, (2ULL << b) - 1, hist[b]);
+
+ out:
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	char *file_name = "/dev/cmidid0";
+	int settle_ms = 100;
+	struct cmidid_event_ring_header hdr;
+	struct cmidid_event *events;
+	struct timespec settle;
+	size_t size;
+	char *ring;
+	uint32_t seq;
+	int fd, num;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <stroke file> [device] "
+			"[settle time in ms]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2)
+		file_name = argv[2];
+	if (argc > 3)
+		settle_ms = atoi(argv[3]);
+
+	if (parse_stroke_file(argv[1]) < 0)
+		return 2;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd == -1) {
+		perror("open failed");
+		return 2;
+	}
+
+	ring = mmap(NULL, sizeof(hdr), PROT_READ, MAP_SHARED, fd,
+		    CMIDID_MMAP_EVENT_RING);
+	if (ring == MAP_FAILED) {
+		perror("mmap failed");
+		return 2;
+	}
+	memcpy(&hdr, ring, sizeof(hdr));
+	munmap(ring, sizeof(hdr));
+
+	size = hdr.data_offset + (size_t)hdr.num_records * hdr.record_size;
+	ring = mmap(NULL, size, PROT_READ, MAP_SHARED, fd,
+		    CMIDID_MMAP_EVENT_RING);
+	if (ring == MAP_FAILED || hdr.record_size != sizeof(struct cmidid_event)) {
+		perror("mmap failed");
+		return 2;
+	}
+
+	seq = ((volatile struct cmidid_event_ring_header *)ring)->head;
+
+	if (replay(fd) < 0) {
+		release_gpios(fd);
+		return 1;
+	}
+
+	/* Wait for the last edges to be debounced. */
+	settle.tv_sec = settle_ms / 1000;
+	settle.tv_nsec = (settle_ms % 1000) * 1000000L;
+	nanosleep(&settle, NULL);
+	release_gpios(fd);
+
+	if ((num = read_ring(ring, seq, &events)) < 0) {
+		fprintf(stderr, "event ring overflowed; increase "
+			"event_ring_size\n");
+		return 1;
+	}
+
+	printf("edges: %d\n", num_edges);
+	report_velocities(events, num);
+	report_latencies(events, num);
+
+	free(events);
+	munmap(ring, size);
+	close(fd);
+
+	return 0;
+}
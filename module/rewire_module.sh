@@ -5,11 +5,11 @@ aconnect -x
 
 ./start_module.sh
 
-CMIDID_PORT=$(aconnect -i | grep -i "cmidid" | awk '{print $2}' | sed -e 's/://')
-echo "Using ALSA port ${CMIDID_PORT} for our cmidid kernel module."
-
 FSYNTH_PORT=$(aconnect -o | grep -i "fluid synth" | awk '{print $2}' | sed -e 's/://')
 echo "Using ALSA port ${FSYNTH_PORT} for FLUID Synth."
 
-# Connect our module with FLUID Synth as output.
-aconnect ${CMIDID_PORT}:0 ${FSYNTH_PORT}:0
+# Connect every keyboard of our module with FLUID Synth as output.
+for CMIDID_PORT in $(aconnect -i | grep -i "cmidid" | awk '{print $2}' | sed -e 's/://'); do
+	echo "Using ALSA port ${CMIDID_PORT} for our cmidid kernel module."
+	aconnect ${CMIDID_PORT}:0 ${FSYNTH_PORT}:0
+done